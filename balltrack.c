@@ -45,9 +45,12 @@
 //
 
 #include "bzerker.h"
+#include "bzembedded.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
 #include "balltrack.h"
 
 
@@ -77,7 +80,7 @@ void init_physics () {
   //   The observations we have:  
   for (i = 0; i < TVIS; i++) {
     qball_vec [i] = 0;
-    qtrack_vec [1] = 0;
+    qtrack_vec [i] = 0;
   }
 }
 
@@ -228,8 +231,218 @@ void update_reward () {
 }
 				      
 
-void main ()
+////////////////////////////////////////////////////////////////
+//
+//    Lots of balls at once.   "balltrack N" runs N independent balls
+//    and tracks in lockstep, all feeding (and learning into) the one
+//    brain.   The physics is the same as above, but kept as structure
+//    of arrays - one array per variable, one slot per environment - and
+//    written without branches (selects and 0/1 multipliers) and with a float
+//    polynomial for sin, so the compiler can do each step eight or
+//    sixteen environments at a time.   Actions for the whole farm come
+//    from one bz_nextaction_many call.
+
+typedef struct {
+  long n;
+  float *track_ang;
+  float *target;           //  where each track is heading, from cmd
+  float *ball_x, *ball_v;
+  float *reward;
+  int *qball, *qtrack;     //  [TVIS][n], oldest first, like qball_vec
+  long *state;
+  long *cmd;
+  bz_chain **chains;
+} ball_farm;
+
+//    sin() for small angles.   The track never tips more than 0.2
+//    radians, where this is good to better than 1e-9.
+static inline float small_sinf (float x) {
+  float x2 = x * x;
+  return x * (1.0f + x2 * (-1.0f/6 + x2 * (1.0f/120 - x2 * (1.0f/5040))));
+}
+
+ball_farm *new_farm (bz_brain *brain, long n) {
+  ball_farm *f;
+  long e;
+  int t;
+  f = malloc (sizeof (ball_farm));
+  f->n = n;
+  f->track_ang = malloc (sizeof (float) * n);
+  f->target = malloc (sizeof (float) * n);
+  f->ball_x = malloc (sizeof (float) * n);
+  f->ball_v = malloc (sizeof (float) * n);
+  f->reward = malloc (sizeof (float) * n);
+  f->qball = malloc (sizeof (int) * TVIS * n);
+  f->qtrack = malloc (sizeof (int) * TVIS * n);
+  f->state = malloc (sizeof (long) * n);
+  f->cmd = malloc (sizeof (long) * n);
+  f->chains = malloc (sizeof (bz_chain *) * n);
+  for (e = 0; e < n; e++) {
+    f->track_ang[e] = INITIAL_TRACK_ANGLE;
+    f->ball_x[e] = INITIAL_BALL_X;
+    f->ball_v[e] = INITIAL_BALL_V;
+    f->cmd[e] = (ACTIONS - 1) / 2;
+    for (t = 0; t < TVIS; t++)
+      f->qball[t * n + e] = f->qtrack[t * n + e] = 0;
+    //   each ball remembers just its last TVIS+1 moves
+    f->chains[e] = bz_newringchain (brain, TVIS + 1);
+  }
+  return (f);
+}
+
+void kill_farm (ball_farm *f) {
+  long e;
+  for (e = 0; e < f->n; e++) bz_killchain (f->chains[e]);
+  free (f->track_ang); free (f->target); free (f->ball_x); free (f->ball_v); free (f->reward);
+  free (f->qball); free (f->qtrack); free (f->state); free (f->cmd);
+  free (f->chains);
+  free (f);
+}
+
+//    Steps 1, 2, 3 and 5 of the big loop below, for n environments.
+//    Everything here is a plain float or int array, and nothing in the
+//    loop depends on any other environment.
+static void step_physics (long n, const float *restrict target,
+			  float *restrict ang, float *restrict x,
+			  float *restrict v, float *restrict reward,
+			  int *restrict qt, int *restrict qb) {
+  long e;
+  //   the physics constants, as floats so nothing gets done in double
+  const float slew = TRACK_SLEW_RATE * TIMESTEP;
+  const float mass = BALL_MASS, timestep = TIMESTEP, tracklen = TRACKLEN;
+  const float angmin = TRACKANGMIN, angmax = TRACKANGMAX;
+  const float fricthresh = BALL_VEL_FRIC_THRESH, bounce = BALL_BOUNCE;
+  const float staticfric = BALL_MASS * BALL_STATIC_FRIC;
+  const float dynfric = BALL_MASS * BALL_DYN_FRIC;
+  const float setpoint_x = BALL_SETPOINT, maxreward = BALL_MAXREWARD;
+  const float abstaper = BALL_ABS_TAPER, sqtaper = BALL_SQUARED_TAPER;
+  for (e = 0; e < n; e++) {
+    //   the track slews toward its setpoint
+    float d = target[e] - ang[e];
+    float step = (d > 0) ? slew : -slew;
+    step = (fabsf (d) < slew) ? d : step;    //  close enough; just go there
+    float a = ang[e] + step;
+    ang[e] = a;
+    //   gravity along the track, and friction against the motion
+    float fric = (v[e] < fricthresh) ? staticfric : dynfric;
+    float force = mass * small_sinf (a) + ((v[e] > 0.0f) ? -fric : fric);
+    float vel = v[e] + (force / mass) * timestep;
+    float pos = x[e] + vel * timestep;
+    //   bumpers at both ends (as 0/1 multipliers: select-style bumpers
+    //   get jump-threaded back into branches, and then nothing vectorizes)
+    float under = pos < 0.0f, over = pos > tracklen;
+    float hit = under + over;
+    x[e] = pos = pos * (1.0f - hit) + over * tracklen;
+    v[e] = vel * (1.0f - hit * (1.0f + bounce));
+    //   what the brain gets to see
+    qt[e] = (NTRACKQ - 0.5f) * ((a - angmin) / (angmax - angmin));
+    qb[e] = (int) (pos * (NBALLQ - 0.5f)) / (tracklen);
+    //   and how well we're doing
+    float err = fabsf (pos - setpoint_x);
+    reward[e] = maxreward - abstaper * err - sqtaper * err * err;
+  }
+}
+
+//    One step of the whole farm, up to (not including) learning.
+void step_farm (ball_farm *f) {
+  long e, n = f->n;
+  int t;
+  const float cmdstep = (TRACKANGMAX - TRACKANGMIN) / ((float) ACTIONS - 1);
+
+  //   slide the queues down (nothing to do when TVIS is 1)
+  for (t = 0; t < TVIS - 1; t++) {
+    memcpy (&f->qball[t * n], &f->qball[(t + 1) * n], sizeof (int) * n);
+    memcpy (&f->qtrack[t * n], &f->qtrack[(t + 1) * n], sizeof (int) * n);
+  }
+  //   commands to angles first (long to float won't go into SIMD lanes)
+  for (e = 0; e < n; e++)
+    f->target[e] = (int) f->cmd[e] * cmdstep + TRACKANGMIN;
+  step_physics (n, f->target, f->track_ang, f->ball_x, f->ball_v, f->reward,
+		&f->qtrack[(TVIS - 1) * n], &f->qball[(TVIS - 1) * n]);
+  //   the queues as a base NBALLQ & NTRACKQ number, as que_to_quan_state
+  for (e = 0; e < n; e++) f->state[e] = 0;
+  {
+    long bmax = 1;
+    for (t = 0; t < TVIS; t++) {
+      const int *restrict qbt = &f->qball[t * n];
+      const int *restrict qtt = &f->qtrack[t * n];
+      for (e = 0; e < n; e++)
+	f->state[e] += qbt[e] * bmax + qtt[e] * bmax * NBALLQ;
+      bmax = bmax * NBALLQ * NTRACKQ;
+    }
+  }
+}
+
+//    Run the whole farm for "steps" steps, learning as we go.
+void run_farm (bz_brain *brain, long n, long steps) {
+  ball_farm *f;
+  long reps, e;
+  double t0, t1, meanreward;
+  struct timespec ts;
+  f = new_farm (brain, n);
+  printf (" I will run %ld environment-steps (%ld balls, %ld steps each).\n",
+	  n * steps, n, steps);
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  t0 = ts.tv_sec + ts.tv_nsec * 1e-9;
+  meanreward = 0;
+  for (reps = 0; reps < steps; reps++) {
+    step_farm (f);
+    //   here the brain really is driving the track
+    for (e = 0; e < n; e++) {
+      bz_addtochain (f->chains[e], f->state[e], f->cmd[e], NULL);
+      if (reps > TVIS)
+	bz_learnchain (brain, f->chains[e], f->reward[e], 1.0, NULL);
+    }
+    bz_nextaction_many (brain, NULL, n, f->state, NULL, NULL, 0,
+			f->cmd, NULL);
+    if (reps == steps - 1)
+      for (e = 0; e < n; e++) meanreward += f->reward[e] / n;
+  }
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  t1 = ts.tv_sec + ts.tv_nsec * 1e-9;
+  printf (" Final mean reward %f over %ld balls\n", meanreward, n);
+  printf (" %.0f environment-steps/sec, %.0f times faster than realtime\n",
+	  n * steps / (t1 - t0), n * steps * TIMESTEP / (t1 - t0));
+  kill_farm (f);
+}
+
+//    The telemetry values we keep each step, after state/action/reward.
+enum { TV_ANGLE, TV_X, TV_V, TV_BQ, TV_TQ, TV_ERR, TV_COUNT };
+
+//    "balltrack --dump FILE": print a run's telemetry the way the loop
+//    used to print it as it went.
+int dump_telemetry (char *filename) {
+  FILE *f;
+  char magic[8];
+  int32_t size;
+  bz_telrecord rec;
+  long n;
+  f = fopen (filename, "rb");
+  if (f == NULL
+      || fread (magic, 1, 8, f) != 8 || memcmp (magic, BZ_TELMAGIC, 8) != 0
+      || fread (&size, sizeof (size), 1, f) != 1
+      || size != sizeof (bz_telrecord)) {
+    fprintf (stderr, "balltrack: %s isn't telemetry I can read\n", filename);
+    return (1);
+  }
+  n = 0;
+  while (fread (&rec, sizeof (rec), 1, f) == 1) {
+    printf ("Cycle: %ld TC: %d  A: %f  X: %f  V: %f BQ: %.0f  TQ: %.0f  Err: %f  Score: %f  ns: %d\n",
+	    (long) rec.step, rec.action,
+	    rec.values[TV_ANGLE], rec.values[TV_X], rec.values[TV_V],
+	    rec.values[TV_BQ], rec.values[TV_TQ], rec.values[TV_ERR],
+	    rec.reward, rec.latency);
+    n++;
+  }
+  fclose (f);
+  fprintf (stderr, " %ld records\n", n);
+  return (0);
+}
+
+int main (int argc, char **argv)
 {
+  if (argc > 2 && strcmp (argv[1], "--dump") == 0)
+    return (dump_telemetry (argv[2]));
   printf ("Starting Ball and Track test - balancing a ball\n");
   bz_init();
   printf ("Important Params:");
@@ -239,15 +452,66 @@ void main ()
   
   printf (" Initializing the brain.\n");
   bz_brain *brain1;
-  brain1 = bz_newbrain (BZ_BRAIN_QUANTIZED, STATES, ACTIONS, TOKENS);
+#ifdef FACTORED
+  {
+    //   quan_state is already one (ball, track) digit per timestep
+    long sizes[TVIS];
+    int t;
+    for (t = 0; t < TVIS; t++) sizes[t] = NBALLQ * NTRACKQ;
+    brain1 = bz_newbrain_factored (TVIS, sizes, ACTIONS, TOKENS);
+  }
+#else
+  brain1 = bz_newbrain (BRAINTYPE, STATES, ACTIONS, TOKENS);
+#endif
   printf ("Got brains! pointer is 0x%lx\n", (long) brain1);
-  bz_chain *chain1;
-  chain1 = bz_newchain (brain1);
-  printf ("Got chains!  pointer is 0x%lx\n", (long) chain1);
+  if (argc > 1) {
+    //   balltrack NBALLS [STEPS]: the lockstep farm instead
+    long nballs = atol (argv[1]);
+    run_farm (brain1, nballs > 0 ? nballs : 1,
+	      argc > 2 ? atol (argv[2]) : REPEATS);
+    bz_killbrain (brain1);
+    return (0);
+  }
+  bz_telemetry *tel;
+  tel = NULL;
+#ifdef TELEMETRY
+  tel = bz_newtelemetry (TELEMETRY, 4096);
+  if (tel == NULL) exit (1);
+#endif
+#ifdef EMBEDDED
+  //   the same controller on bzembedded: its brain and chain live in
+  //   storage we hand it (just main's stack here), and tokens and
+  //   rewards are 16.16 fixed point
+  bz_efix etokens[BZ_ETOKENS (STATES, ACTIONS)];
+  bz_elink elinks[TVIS + 1];
+  bz_ebrain ebrain;
+  bz_echain echain;
+  struct timespec t0, t1;
+  bz_telrecord rec;
+  if (bz_ebrain_init (&ebrain, etokens, STATES, ACTIONS, BZ_EFIX (TOKENS), 1)
+      || bz_echain_init (&echain, elinks, TVIS + 1)) {
+    fprintf (stderr, "balltrack: bzembedded didn't like the shape\n");
+    exit (1);
+  }
+  printf ("Got chains!  (bzembedded, %d links)\n", TVIS + 1);
+#else
+  //   the real-time controller: it keeps a ring of TVIS+1 links (just
+  //   our memory step length), learns, and picks, all without a malloc
+  bz_controller *ctl;
+  ctl = bz_newcontroller (brain1, TVIS + 1, NULL, 1.0, tel);
+  if (ctl == NULL) exit (1);
+  printf ("Got a controller!  It remembers %d steps.\n", TVIS + 1);
+#endif
+#ifdef EPISODE_LOG
+  bz_logwriter *log1;
+  log1 = bz_openlog (EPISODE_LOG, ACTIONS);
+  if (log1 == NULL) exit (1);
+#endif
   
   printf (" I will run %d steps of balancing, and report every %d steps.\n",
 	  REPEATS, BATCHSIZE);
-  long reps, i, j, action, batch;
+  long reps;
+  float values[TV_COUNT];
 
   //   The big loop, where we repeatedly:
   //   (0 - initialize only)
@@ -255,9 +519,9 @@ void main ()
   //   2)  move the ball
   //   3)  quantize the track and ball
   //   4)  update the current-and-prior state queues
-  //   5)  update the reward
-  //   6)  train the brain (if we should)
-  //   7)  ask the brain what to do next
+  //   6)  observe and learn what we did (bz_steptaken), telemetry on the side
+  //   6)  observe, learn and act (bz_step), telemetry on the side
+  //   7)  wait for the next tick, if we're keeping real time
   //   .... for REPEAT reps.
 
   //   initialize physics and stuff.
@@ -278,21 +542,67 @@ void main ()
     set_quantized_state_queues ();
     //   5)  update the reward
     update_reward ();
-    //   6)  train the brain (if we should)
     que_to_quan_state();
-    bz_addtochain (chain1, quan_state, track_cmd, NULL);    // remember what we did
-    bz_truncatechain (chain1, TVIS); //  .... but only for our memory step length
-    //       ... only train if we've actually filled the queues
-    if (reps > TVIS) {
-      bz_learnchain (brain1, chain1, cur_reward, 1.0, NULL);
+    values[TV_ANGLE] = track_ang;
+    values[TV_X] = ball_x;
+    values[TV_V] = ball_v;
+    values[TV_BQ] = quantized_ball_x;
+    values[TV_TQ] = quantized_track_ang;
+    values[TV_ERR] = BALL_SETPOINT - ball_x;
+    //   6)  observe and learn.   The track ran on track_cmd (2, from step
+    //       1 - the brain is only watching), so that's what we remember;
+    //       to let the brain drive, drop the override and take bz_step's
+    //       pick instead.
+#ifdef EMBEDDED
+    clock_gettime (CLOCK_MONOTONIC, &t0);
+    if (echain.count == echain.capacity)
+      bz_elearnchain (&ebrain, &echain, (bz_efix) (cur_reward * BZ_EONE),
+		      BZ_EONE);
+    bz_eaddtochain (&echain, quan_state, track_cmd);
+    clock_gettime (CLOCK_MONOTONIC, &t1);
+    if (tel) {
+      memset (&rec, 0, sizeof (rec));
+      rec.step = reps;
+      rec.state = quan_state;
+      rec.action = track_cmd;
+      rec.reward = cur_reward;
+      rec.latency = (t1.tv_sec - t0.tv_sec) * 1000000000
+	+ (t1.tv_nsec - t0.tv_nsec);
+      rec.nvalues = TV_COUNT;
+      memcpy (rec.values, values, sizeof (values));
+      bz_telemetrypush (tel, &rec);
     }
-    //   7)  ask the brain what to do next
-    track_cmd = bz_nextaction (brain1, quan_state, NULL, NULL, NULL);
-    //   8)   record statistics and output trace 
-    printf ("Cycle: %d Br: 0x%lx Ch: 0x%lx TC: %d  A: %f  X: %f  V: %f BQ: %d  TQ: %d  Err: %f  Score: %f\n",
-	    reps, brain1, chain1,
-	    track_cmd, track_ang, ball_x, ball_v,
-	    quantized_ball_x, quantized_track_ang,
-	    BALL_SETPOINT - ball_x, cur_reward); 
+#else
+#ifdef EPISODE_LOG
+    //   (bz_steptaken is about to learn these with this reward)
+    if (bz_controllerchain (ctl)->totalcount == TVIS + 1)
+      bz_logchain (log1, bz_controllerchain (ctl), cur_reward, 1.0);
+#endif
+    bz_steptaken (ctl, quan_state, cur_reward, track_cmd, NULL,
+		  values, TV_COUNT);
+    //   7)  a real track wants its command every TIMESTEP, on the dot
+#ifdef REALTIME
+    bz_waitstep (ctl, TIMESTEP);
+#endif
+#endif
   }  
+  //   the last step, the way the old per-cycle trace put it
+  printf ("Cycle: %ld TC: %d  A: %f  X: %f  V: %f BQ: %d  TQ: %d  Err: %f  Score: %f\n",
+	  reps - 1, track_cmd, track_ang, ball_x, ball_v,
+	  quantized_ball_x, quantized_track_ang,
+	  BALL_SETPOINT - ball_x, cur_reward);
+#ifdef EPISODE_LOG
+  bz_closelog (log1);
+#endif
+#ifndef EMBEDDED
+  bz_killcontroller (ctl);
+#endif
+#ifdef TELEMETRY
+  long dropped;
+  dropped = bz_killtelemetry (tel);
+  printf (" Telemetry is in %s (%ld dropped); balltrack --dump %s shows it.\n",
+	  TELEMETRY, dropped, TELEMETRY);
+#endif
+  bz_killbrain (brain1);
+  return (0);
 }
@@ -89,6 +89,16 @@ int qtrack_vec [TVIS];
 long unsigned quan_state;
 
 //    The following are BZERKER parameters
+//   what kind of brain - BZ_BRAIN_COMPACT stores each box in 16 bits,
+//   which helps the bigger TVIS = 3 or 4 setups fit small machines
+#define BRAINTYPE BZ_BRAIN_QUANTIZED
+//   or uncomment to give each of the TVIS timesteps its own little
+//   (ball, track) brain and pool them - TVIS * 25 rows instead of 25^TVIS
+//#define FACTORED
+//   or uncomment to run the single-ball controller on bzembedded, the
+//   fixed-point, malloc-free core for small boards (this ignores
+//   BRAINTYPE and FACTORED; the farm still uses bzerker)
+//#define EMBEDDED
 //   how many tokens per Michie box
 #define TOKENS 100
 //   how many cycles of the game to run
@@ -103,6 +113,17 @@ long unsigned quan_state;
 #define DRAW_ADD 0.01
 #define DRAW_MUL 1.0
 #define PRINT_EACHGAME 0
+//   uncomment to append every training window to an episode log, so a
+//   real rig's experience can be replayed later with bz_replaylog
+//#define EPISODE_LOG "balltrack.bzlog"
+//   uncomment to send every step's state, action, reward, timing and
+//   physics to this file, in binary, from a background thread
+//   (balltrack --dump reads it back)
+//#define TELEMETRY "balltrack.bztel"
+//   uncomment to run at one step per TIMESTEP of wall-clock time, as a
+//   physical track would need, instead of as fast as we can simulate
+//   (not with EMBEDDED)
+//#define REALTIME
 
 //     The reward parameters - how close is the _real_ ball to the _real_
 //     setpoint?
@@ -0,0 +1,263 @@
+//   Benchmarks for the bzerker library implementing Mitchie's BOXES algorithm
+//   Copyright 2017-2018 W.S.Yerazunis, released under the GPL V2 or later
+//
+//
+//  Times the hot paths of the library, and the two demo programs end to
+//  end, and prints one CSV line per measurement so the results can be
+//  diffed, plotted, or compared between builds:
+//
+//     benchmark,states,actions,variant,ops,seconds,ns_per_op
+//
+//  Run it with "make PROFILE=release bench" (numbers from a -O0 debug
+//  build don't mean much); the output also lands in
+//  build/<profile>/bench_output.txt.
+//
+//  Usage:  bench                   micro + end-to-end
+//          bench micro             just the library calls
+//          bench e2e               just ./tictactoe and ./balltrack (one
+//                                  ball, then a 1024-ball farm)
+//
+#include "bzerker.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//   How many calls per microbenchmark, and the short "episode" length
+#define OPS 1000000
+#define EPISODE 64
+#define WINDOW 4
+#define NSTATEPICKS 65536
+#define NMASKS 64
+
+//   The brain shapes we try: ball-and-track-ish, tic-tac-toe, and wide.
+static struct { int states, actions; } shapes[] = {
+  { 125, 3 },
+  { 19683, 9 },
+  { 100000, 64 },
+};
+#define NSHAPES ((int) (sizeof (shapes) / sizeof (shapes[0])))
+
+//   Somewhere to put results so the compiler can't throw the work away.
+volatile long sink;
+
+double now () {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void report (char *name, int states, int actions, char *variant,
+	     long ops, double seconds) {
+  printf ("%s,%d,%d,%s,%ld,%.6f,%.2f\n", name, states, actions, variant,
+	  ops, seconds, ops ? seconds * 1e9 / ops : 0.0);
+  fflush (stdout);
+}
+
+//   Random states to visit, and a few masks (about 2/3 of actions legal,
+//   never none) in both char and packed-bit form.
+long *statepicks;
+char *masks;
+bz_maskword *maskbits;
+
+void make_inputs (bz_brain *brain, bz_rng *rng) {
+  int i, a, words;
+  words = BZ_MASKWORDS (brain->maxactions);
+  for (i = 0; i < NSTATEPICKS; i++)
+    statepicks[i] = bz_rng_next (rng) % brain->maxstates;
+  for (i = 0; i < NMASKS; i++) {
+    for (a = 0; a < brain->maxactions; a++)
+      masks[i * brain->maxactions + a] = (bz_rng_next (rng) % 3) ? 1 : -1;
+    masks[i * brain->maxactions + (i % brain->maxactions)] = 1;
+    bz_maskbits (brain, &masks[i * brain->maxactions], &maskbits[i * words]);
+  }
+}
+
+void bench_nextaction (char *name, bz_brain *brain) {
+  static struct { char *name; float evse; int usevse; int mask; } v[] = {
+    { "flat-nomask", 1.0, 0, 0 },
+    { "flat-charmask", 1.0, 0, 1 },
+    { "flat-bitmask", 1.0, 0, 2 },
+    { "evse2-nomask", 2.0, 1, 0 },
+    { "evse2-charmask", 2.0, 1, 1 },
+    { "evse2-bitmask", 2.0, 1, 2 },
+    { "evse2.7-charmask", 2.7, 1, 1 },
+  };
+  int iv, words;
+  long i, total;
+  double t0;
+  words = BZ_MASKWORDS (brain->maxactions);
+  for (iv = 0; iv < (int) (sizeof (v) / sizeof (v[0])); iv++) {
+    total = 0;
+    t0 = now ();
+    for (i = 0; i < OPS; i++) {
+      long state = statepicks[i % NSTATEPICKS];
+      int m = i % NMASKS;
+      float *evse = v[iv].usevse ? &v[iv].evse : NULL;
+      if (v[iv].mask == 2)
+	total += bz_nextaction_bits (brain, NULL, state, evse,
+				     &maskbits[m * words], NULL);
+      else
+	total += bz_nextaction (brain, state, evse,
+				v[iv].mask ? &masks[m * brain->maxactions] : NULL,
+				NULL);
+    }
+    report (name, brain->maxstates, brain->maxactions, v[iv].name,
+	    OPS, now () - t0);
+    sink += total;
+  }
+}
+
+//   The batch entry point, 256 environments at a time, each with its
+//   own mask (what a lockstep simulator would hand us).
+#define BATCH 256
+void bench_many (bz_brain *brain) {
+  long states[BATCH], actions[BATCH];
+  bz_maskword *bits;
+  long i, j, total;
+  double t0;
+  int words;
+  float evse = 2.0;
+  words = BZ_MASKWORDS (brain->maxactions);
+  bits = malloc (sizeof (bz_maskword) * words * BATCH);
+  for (j = 0; j < BATCH; j++)
+    memcpy (&bits[j * words], &maskbits[(j % NMASKS) * words],
+	    sizeof (bz_maskword) * words);
+  total = 0;
+  t0 = now ();
+  for (i = 0; i < OPS; i += BATCH) {
+    for (j = 0; j < BATCH; j++)
+      states[j] = statepicks[(i + j) % NSTATEPICKS];
+    bz_nextaction_many (brain, NULL, BATCH, states, &evse, bits, words,
+			actions, NULL);
+    total += actions[0];
+  }
+  report ("nextaction_many", brain->maxstates, brain->maxactions,
+	  "evse2-bitmask-b256", (OPS + BATCH - 1) / BATCH * BATCH, now () - t0);
+  sink += total;
+  free (bits);
+}
+
+void bench_chains (bz_brain *brain) {
+  bz_chain *chain;
+  long i;
+  double t0;
+  chain = bz_newchain (brain);
+
+  //   add a short episode's worth, then zero, over and over
+  t0 = now ();
+  for (i = 0; i < OPS; i++) {
+    bz_addtochain (chain, statepicks[i % NSTATEPICKS], i % brain->maxactions,
+		   &masks[(i % NMASKS) * brain->maxactions]);
+    if (i % EPISODE == EPISODE - 1) bz_zerochain (chain);
+  }
+  report ("addtochain", brain->maxstates, brain->maxactions, "mask",
+	  OPS, now () - t0);
+  bz_zerochain (chain);
+
+  //   learn the same episode-length chain many times (ops = links)
+  for (i = 0; i < EPISODE; i++)
+    bz_addtochain (chain, statepicks[i], i % brain->maxactions, NULL);
+  t0 = now ();
+  for (i = 0; i < OPS / EPISODE; i++)
+    bz_learnchain (brain, chain, (i & 1) ? 1.0 : -1.0, 1.0, NULL);
+  report ("learnchain", brain->maxstates, brain->maxactions, "add",
+	  (OPS / EPISODE) * EPISODE, now () - t0);
+  bz_zerochain (chain);
+
+  //   a ball-and-track style sliding window: add, then truncate
+  t0 = now ();
+  for (i = 0; i < OPS; i++) {
+    bz_addtochain (chain, statepicks[i % NSTATEPICKS], i % brain->maxactions,
+		   NULL);
+    bz_truncatechain (chain, WINDOW);
+  }
+  report ("truncatechain", brain->maxstates, brain->maxactions, "window4",
+	  OPS, now () - t0);
+  bz_killchain (chain);
+
+  //   ... and the same window as a ring chain, which never truncates
+  chain = bz_newringchain (brain, WINDOW + 1);
+  t0 = now ();
+  for (i = 0; i < OPS; i++)
+    bz_addtochain (chain, statepicks[i % NSTATEPICKS], i % brain->maxactions,
+		   NULL);
+  report ("ringchain", brain->maxstates, brain->maxactions, "window4",
+	  OPS, now () - t0);
+  bz_killchain (chain);
+}
+
+void micro () {
+  int is, words;
+  bz_brain *brain;
+  bz_rng rng;
+  bz_rng_seed (&rng, 12345);
+  for (is = 0; is < NSHAPES; is++) {
+    brain = bz_newbrain (BZ_BRAIN_QUANTIZED, shapes[is].states,
+			 shapes[is].actions, 100);
+    bz_seedbrain (brain, 1);
+    words = BZ_MASKWORDS (brain->maxactions);
+    statepicks = malloc (sizeof (long) * NSTATEPICKS);
+    masks = malloc (NMASKS * brain->maxactions);
+    maskbits = malloc (sizeof (bz_maskword) * NMASKS * words);
+    make_inputs (brain, &rng);
+    bench_nextaction ("nextaction", brain);
+    bench_many (brain);
+    bench_chains (brain);
+    bz_killbrain (brain);
+    //   the same again with cache-line padded rows (on huge pages if big)
+    brain = bz_newbrain_padded (shapes[is].states, shapes[is].actions, 100,
+				BZ_ALLOC_HUGEPAGES);
+    bz_seedbrain (brain, 1);
+    bench_nextaction ("nextaction_padded", brain);
+    free (statepicks);
+    free (masks);
+    free (maskbits);
+    bz_killbrain (brain);
+  }
+}
+
+//   End to end: run a demo, and count its work from what it says it's
+//   about to do ("play N double-games" is 2N games; "run N steps").
+void e2e (char *name, char *command, char *pattern, long per) {
+  FILE *p;
+  char line[4096], *at;
+  long n, ops;
+  double t0, t;
+  ops = 0;
+  t0 = now ();
+  p = popen (command, "r");
+  if (p == NULL) {
+    fprintf (stderr, "bench: couldn't run %s\n", command);
+    return;
+  }
+  while (fgets (line, sizeof (line), p)) {
+    at = strstr (line, pattern);
+    if (at && ops == 0 && sscanf (at + strlen (pattern), "%ld", &n) == 1)
+      ops = n * per;
+  }
+  //   (the demos don't bother returning a status, so don't check it)
+  pclose (p);
+  t = now () - t0;
+  if (ops == 0) {
+    fprintf (stderr, "bench: %s never said how much work it did\n", command);
+    return;
+  }
+  report (name, 0, 0, "wallclock", ops, t);
+}
+
+int main (int argc, char **argv) {
+  int domicro, doe2e;
+  domicro = doe2e = 1;
+  if (argc > 1 && strcmp (argv[1], "micro") == 0) doe2e = 0;
+  if (argc > 1 && strcmp (argv[1], "e2e") == 0) domicro = 0;
+  bz_init ();
+  printf ("benchmark,states,actions,variant,ops,seconds,ns_per_op\n");
+  if (domicro) micro ();
+  if (doe2e) {
+    e2e ("tictactoe", "./tictactoe", "I would like to play ", 2);
+    e2e ("balltrack", "./balltrack", "I will run ", 1);
+    e2e ("balltrack-farm", "./balltrack 1024 2000", "I will run ", 1);
+  }
+  return 0;
+}
@@ -0,0 +1,222 @@
+//   bzembedded - the BOXES core cut down for small machines.
+//   Copyright W. S. Yerazunis; released under the GPL version 2 or later.
+//
+//   See bzembedded.h.   Nothing in here may use malloc, stdio or libm -
+//   "make embedded" builds it -ffreestanding and checks that the only
+//   undefined symbols left are compiler helpers.
+
+#include "bzembedded.h"
+
+//    The random stream: a copy of bz_rng (xoshiro128**, splitmix32
+//    seeding), so a seed means the same thing on the host.
+static uint32_t bz__esplitmix32 (uint32_t *x) {
+  uint32_t z;
+  z = (*x += 0x9e3779b9);
+  z = (z ^ (z >> 16)) * 0x85ebca6b;
+  z = (z ^ (z >> 13)) * 0xc2b2ae35;
+  return (z ^ (z >> 16));
+}
+
+void bz_erng_seed (bz_erng *rng, uint32_t seed) {
+  uint32_t x;
+  int i;
+  x = seed;
+  for (i = 0; i < 4; i++)
+    rng->s[i] = bz__esplitmix32 (&x);
+}
+
+static inline uint32_t bz__erotl (uint32_t x, int k) {
+  return (x << k) | (x >> (32 - k));
+}
+
+uint32_t bz_erng_next (bz_erng *rng) {
+  uint32_t *s, result, t;
+  s = rng->s;
+  result = bz__erotl (s[1] * 5, 7) * 9;
+  t = s[1] << 9;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = bz__erotl (s[3], 11);
+  return (result);
+}
+
+int bz_ebrain_init (bz_ebrain *brain, bz_efix *storage, long states,
+		    int actions, bz_efix tokens, uint32_t seed) {
+  long i, n;
+  if (brain == NULL || storage == NULL || states < 1 || actions < 1
+      || actions > BZ_EMAXACTIONS || tokens < BZ_ETOKENMIN)
+    return (1);
+  brain->tokens = storage;
+  brain->maxstates = states;
+  brain->maxactions = actions;
+  brain->starting_tokens = tokens;
+  n = BZ_ETOKENS (states, actions);
+  for (i = 0; i < n; i++) storage[i] = tokens;
+  bz_erng_seed (&brain->rng, seed);
+  return (0);
+}
+
+int bz_efromfloats (bz_ebrain *brain, const float *rows, long states,
+		    int stride) {
+  long s;
+  int a;
+  float v;
+  if (states != brain->maxstates || stride < brain->maxactions) return (1);
+  for (s = 0; s < states; s++)
+    for (a = 0; a < brain->maxactions; a++) {
+      v = rows[s * stride + a] * (float) BZ_EONE;
+      if (v >= 2147483520.0f)          //  biggest float below 2^31
+	brain->tokens[s * brain->maxactions + a] = BZ_ETOKENMAX;
+      else if (v >= BZ_ETOKENMIN)
+	brain->tokens[s * brain->maxactions + a] = (bz_efix) (v + 0.5f);
+      else                             //  too small, negative, or NaN
+	brain->tokens[s * brain->maxactions + a] = BZ_ETOKENMIN;
+    }
+  return (0);
+}
+
+//    The choice.   Everything is done with masks and compares so the
+//    compiler has nothing to branch on: illegal actions are weighted 0
+//    rather than skipped, a dry box's refill is a select over the whole
+//    row, and the walk to the chosen action goes all the way to the end
+//    and just remembers the first place the running total passed the
+//    draw.
+int bz_enextaction (bz_ebrain *brain, long state, int evse, uint32_t legal) {
+  bz_efix *row;
+  uint64_t w[BZ_EMAXACTIONS], sum, acc, target, inv, x, p, m64, flat;
+  uint32_t r, bit, m, dry;
+  int i, e, n, nlegal, pick, found, hit;
+  n = brain->maxactions;
+  legal &= BZ_EALL (n);
+  if (state < 0 || state >= brain->maxstates || legal == 0
+      || evse < 0 || evse > BZ_EMAXEVSE)
+    return (-1);
+  row = &brain->tokens[state * n];
+
+  //   tokens on the legal moves
+  sum = 0;
+  nlegal = 0;
+  for (i = 0; i < n; i++) {
+    bit = (legal >> i) & 1;
+    w[i] = (uint64_t) (uint32_t) row[i] & (0 - (uint64_t) bit);
+    nlegal += bit;
+    sum += w[i];
+  }
+
+  //   a box down to one token or less among the legal moves gets them
+  //   all refilled, as in bzerker (which also counts it as an underflow)
+  dry = sum <= BZ_EONE;
+  sum = 0;
+  for (i = 0; i < n; i++) {
+    m = 0 - (dry & (legal >> i) & 1);
+    m64 = 0 - (uint64_t) (m & 1);
+    row[i] = (bz_efix) (((uint32_t) row[i] & ~m)
+			| ((uint32_t) brain->starting_tokens & m));
+    w[i] = (w[i] & ~m64)
+      | ((uint64_t) (uint32_t) brain->starting_tokens & m64);
+    sum += w[i];
+  }
+
+  //   evse 0: every legal move weighs 1, as pow (ratio, 0) does in
+  //   bzerker - pure explore.   (Done every call, for the cycle count.)
+  flat = 0 - (uint64_t) (evse == 0);
+  sum = 0;
+  for (i = 0; i < n; i++) {
+    w[i] = (w[i] & ~flat) | ((uint64_t) ((legal >> i) & 1) & flat);
+    sum += w[i];
+  }
+
+  //   evse: weight by (tokens / average) ^ evse, in 16.16.   The ratio
+  //   is at most nlegal (2^21 in 16.16), so even the ^4 fits in 64 bits.
+  //   A legal move always keeps at least the smallest weight, so it
+  //   can't be ruled out by rounding.
+  if (evse > 1) {
+    inv = (((uint64_t) nlegal) << 32) / sum;
+    sum = 0;
+    for (i = 0; i < n; i++) {
+      x = (w[i] * inv) >> 16;
+      p = x;
+      for (e = 1; e < evse; e++) p = (p * x) >> 16;
+      bit = (legal >> i) & 1;
+      p += (p == 0) & bit;
+      w[i] = p;
+      sum += p;
+    }
+  }
+
+  //   draw in [0, sum) - sum can be over 32 bits, so multiply in halves
+  r = bz_erng_next (&brain->rng);
+  target = (sum >> 32) * r + (((sum & 0xffffffff) * r) >> 32);
+  acc = 0;
+  pick = 0;
+  found = 0;
+  for (i = 0; i < n; i++) {
+    acc += w[i];
+    hit = (target < acc) & !found;
+    pick |= (0 - hit) & i;
+    found |= hit;
+  }
+  return (pick);
+}
+
+int bz_elearn (bz_ebrain *brain, long state, int action, bz_efix add,
+	       bz_efix multiply) {
+  bz_efix *row;
+  int64_t t, tokensum;
+  int i;
+  if (state < 0 || state >= brain->maxstates || action < 0
+      || action >= brain->maxactions)
+    return (1);
+  row = &brain->tokens[state * brain->maxactions];
+  //   (rounded, or a multiply just under 1 drags everything down)
+  t = (int64_t) add
+    + (((int64_t) multiply * row[action] + (BZ_EONE / 2)) >> 16);
+  if (t > BZ_ETOKENMAX) t = BZ_ETOKENMAX;
+  if (t <= BZ_ETOKENMIN) {
+    row[action] = BZ_ETOKENMIN;
+    //   same "whole box ran dry" check as bzerker's learn
+    tokensum = 0;
+    for (i = 0; i < brain->maxactions; i++) tokensum += row[i];
+    if (tokensum <= (int64_t) BZ_ETOKENMIN * brain->maxactions
+	* brain->maxactions)
+      for (i = 0; i < brain->maxactions; i++)
+	row[i] = brain->starting_tokens;
+    return (0);
+  }
+  row[action] = (bz_efix) t;
+  return (0);
+}
+
+int bz_echain_init (bz_echain *chain, bz_elink *storage, int capacity) {
+  if (chain == NULL || storage == NULL || capacity < 1) return (1);
+  chain->links = storage;
+  chain->capacity = capacity;
+  chain->head = 0;
+  chain->count = 0;
+  return (0);
+}
+
+void bz_eaddtochain (bz_echain *chain, long state, int action) {
+  chain->links[chain->head].state = state;
+  chain->links[chain->head].action = action;
+  if (++chain->head == chain->capacity) chain->head = 0;
+  if (chain->count < chain->capacity) chain->count++;
+}
+
+void bz_ezerochain (bz_echain *chain) {
+  chain->head = 0;
+  chain->count = 0;
+}
+
+int bz_elearnchain (bz_ebrain *brain, bz_echain *chain, bz_efix add,
+		    bz_efix multiply) {
+  int i, bad;
+  bad = 0;
+  for (i = 0; i < chain->count; i++)
+    bad += bz_elearn (brain, chain->links[i].state, chain->links[i].action,
+		      add, multiply);
+  return (bad);
+}
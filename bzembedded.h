@@ -0,0 +1,130 @@
+//   bzembedded - the BOXES core cut down for small machines.
+//   Copyright W. S. Yerazunis; released under the GPL version 2 or later.
+//
+//   bzerker.h asks "How small can we make it?   DSPic-small?
+//   Arduino-small?"   This is the answer so far: the same algorithm,
+//   freestanding (it needs <stdint.h> and <stddef.h> and nothing else -
+//   no malloc, no stdio, no libm), with
+//
+//     -  the caller's storage for the brain and the chain, so everything
+//        can be a static array (use BZ_ETOKENS to size the brain);
+//     -  16.16 fixed-point tokens instead of floats;
+//     -  the same xoshiro128** as bz_rng, seeded the same way, built in;
+//     -  a bz_enextaction whose running time doesn't depend on the
+//        tokens, the mask, or the random draw: every loop runs exactly
+//        maxactions times, there are no early exits, and the only
+//        library call a compiler may add is one 64-bit divide (and only
+//        when evse > 1).   So the worst case is the case, and you can
+//        count it once on your part.
+//
+//   It's a separate little library (make embedded builds it with
+//   -ffreestanding into build/embedded/libbzembedded.a) so the big one
+//   can keep its threads and files.   Train on the host with bzerker,
+//   move the rows over with bz_efromfloats, and keep learning on the
+//   device if you like - learning works the same way, just in fixed point.
+//
+//   What's missing compared to bzerker: hashed / compact / factored
+//   brains, char masks (the legal set is a bitmask, so up to 32 actions),
+//   fractional evse (integer powers 0 to BZ_EMAXEVSE only), and all the
+//   files, logs, and threads.   Errors come back as return codes, since
+//   there's nowhere to print them.
+
+#ifndef BZEMBEDDED_H
+#define BZEMBEDDED_H
+#include <stdint.h>
+#include <stddef.h>
+
+//    Tokens are 16.16 fixed point: BZ_EONE is one token.   BZ_EFIX is
+//    for compile-time constants (it's a double multiply otherwise).
+typedef int32_t bz_efix;
+#define BZ_EONE 65536
+#define BZ_EFIX(x) ((bz_efix) ((x) * BZ_EONE))
+
+//    The fewest tokens a box can hold (TOKENMIN's equivalent), and the
+//    most.
+#define BZ_ETOKENMIN 1
+#define BZ_ETOKENMAX INT32_MAX
+
+//    Most actions a brain can have (the legal set is one 32-bit word),
+//    and the biggest evse power.
+#define BZ_EMAXACTIONS 32
+#define BZ_EMAXEVSE 4
+
+//    How many bz_efix a brain of this shape needs, and a mask with all
+//    of the first "actions" actions legal.
+#define BZ_ETOKENS(states, actions) ((long) (states) * (actions))
+#define BZ_EALL(actions)						\
+  ((actions) >= 32 ? (uint32_t) 0xffffffff				\
+   : (uint32_t) ((((uint32_t) 1) << (actions)) - 1))
+
+//    The random stream - same generator and seeding as bz_rng, so a
+//    seed gives the same numbers on the host and on the device.
+typedef struct my_bz_erng {
+  uint32_t s[4];
+} bz_erng;
+
+typedef struct my_bz_ebrain {
+  bz_efix *tokens;        //  maxstates rows of maxactions, caller's memory
+  long maxstates;
+  int maxactions;
+  bz_efix starting_tokens;
+  bz_erng rng;
+} bz_ebrain;
+
+typedef struct my_bz_elink {
+  long state;
+  int action;
+} bz_elink;
+
+//    A chain is a ring of the last "capacity" steps (like bz_newringchain):
+//    adding to a full one drops the oldest.
+typedef struct my_bz_echain {
+  bz_elink *links;        //  capacity of them, caller's memory
+  int capacity;
+  int head;               //  where the next link goes
+  int count;
+} bz_echain;
+
+void bz_erng_seed (bz_erng *rng, uint32_t seed);
+uint32_t bz_erng_next (bz_erng *rng);
+
+//    Set up a brain in "storage" (BZ_ETOKENS (states, actions) of them),
+//    every box full of "tokens".   Returns 0, or 1 if the shape won't do.
+int bz_ebrain_init (bz_ebrain *brain, bz_efix *storage, long states,
+		    int actions, bz_efix tokens, uint32_t seed);
+
+//    Copy in a brain trained elsewhere: "states" rows of floats, "stride"
+//    apart (brain->rowstride for a bzerker brain, or just maxactions),
+//    rounded to fixed point and kept within TOKENMIN..TOKENMAX.   This one
+//    does use float, so leave it out of a build without an FPU if the
+//    soft-float helpers are too big.   Returns 0, or 1 on a bad shape.
+int bz_efromfloats (bz_ebrain *brain, const float *rows, long states,
+		    int stride);
+
+//    Pick an action for "state" among the set bits of "legal" (use
+//    BZ_EALL for all of them; bits past maxactions are ignored).   evse
+//    1 is plain Michie, 2 to BZ_EMAXEVSE raise the weights to that
+//    power, and 0 is an even choice among the legal moves whatever
+//    their tokens - all the same as bzerker, so an evse tuned on the
+//    host means the same thing here.   A box that has run dry is refilled, as in bzerker.   Same
+//    cycle count every call for a given brain and evse (see the top).
+//    Returns the action, or -1 if the state, the mask or evse is bad.
+int bz_enextaction (bz_ebrain *brain, long state, int evse, uint32_t legal);
+
+//    Learn one step: tokens = add + multiply * tokens (multiply is 16.16
+//    too, so BZ_EONE leaves them alone), kept within TOKENMIN..TOKENMAX,
+//    and refilled if the whole box has run down.   Returns 0, or 1 if
+//    the state or action is out of range.
+int bz_elearn (bz_ebrain *brain, long state, int action, bz_efix add,
+	       bz_efix multiply);
+
+//    Chains, in the caller's array of "capacity" links.
+int bz_echain_init (bz_echain *chain, bz_elink *storage, int capacity);
+void bz_eaddtochain (bz_echain *chain, long state, int action);
+void bz_ezerochain (bz_echain *chain);
+//    bz_elearn every link in the chain.   Returns how many links didn't
+//    fit the brain (0 if all is well).
+int bz_elearnchain (bz_ebrain *brain, bz_echain *chain, bz_efix add,
+		    bz_efix multiply);
+
+#endif
@@ -86,10 +86,14 @@
 //   final action taken from the ensemble result?
 //
 //   The bzerker API also allows multiple simultaneous copies of the
-//   algorithm to run simultaneously with different data (and with luck,
-//   someday it may even run reentrantly so multicore processing may be
-//   eventually possible someday.  But until we make sure it's
-//   reentrant, stick with one thread, OK?)
+//   algorithm to run simultaneously with different data.  Each brain
+//   has its own random stream, so separate brains on separate threads
+//   are fine, and bz_nextaction_r lets several threads sample the same
+//   brain with their own bz_rng.  But sampling writes too (a box that
+//   runs dry gets refilled right there), so using one brain from several
+//   threads at once - sampling or learning - is only safe after
+//   bz_sharebrain(), which puts striped locks on the rows
+//   (bz_trainparallel does the rest).
 //
 // HOW TO USE IT
 //
@@ -148,7 +152,10 @@
 //       action = bz_nextaction (*brain, state, *evse, *mask, *underflows)
 //
 //     which returns an integer action.  The variable *brain is a pointer
-//     to the brain struct, "state" is an integer state of the system
+//     to the brain struct, "state" is an integer state of the system.
+//     The random choice comes from the brain's own generator; call
+//     bz_seedbrain (brain, seed) first if you want a reproducible run,
+//     or use bz_nextaction_r (brain, *rng, ...) to supply your own.
 //
 //     "*evse" is a floating point pointer to the ratio exponentiator and
 //     allows control of the "explore vs. exploit" question.  1.0 is
@@ -160,8 +167,12 @@
 //     This action is local and variable on a per-call basis.  NULL here uses
 //     1.0 as the ratio exponent, which as we say above, is "BOXES Classic".
 //
-//     "*mask" is a *char array of length max_actions, where <=0  entries
-//     mark forbidden actions, and >0 entries mark permitted actions.
+//     "*mask" is a *char array of length max_actions, where <0 entries
+//     mark forbidden actions, and >=0 entries (0 included!) mark
+//     permitted actions - the same everywhere a char mask goes, picking,
+//     bz_maskbits and learning alike.   (Older versions left 0 entries
+//     out of the dry-box re-sum when bz_learnstateaction / bz_learnchain
+//     clamped a box, while picking counted them in; now both count them.)
 //     Note, of course, that using '\0' as a character in a char string
 //     is fraught with peril should you use any function that expects null
 //     terminated strings!!! (bzerker doesn't care, but other cocde might).
@@ -206,14 +217,25 @@
 //
 //     to learn only the last "count" number of ACTIONs on that chain.
 //
-//     Finally, after training the chain, you should deallocate the chain
-//     with bz_killchain.  Otherwise, actions will continue to accumulate,
-//     and you'll leak memory as well.
+//     If you only ever learn a sliding window of the last few moves
+//     (a continuous controller, say), make the chain a ring instead:
 //
-//         b_killchain (*chain);
+//         my_chain = bz_newringchain (my_brain, count + 1);
+//
+//     and each bz_addtochain drops the oldest action once it's full,
+//     without any truncating.
+//
+//     Finally, after training the chain, you should empty the chain
+//     with bz_zerochain so it is ready for the next run.  Otherwise,
+//     actions will continue to accumulate.  Zeroing is cheap (the links
+//     are kept for reuse); when you're done with the chain for good,
+//     give its memory back with bz_killchain.
+//
+//         bz_zerochain (*chain);
+//         bz_killchain (*chain);
 //
 //     Congratulations; you've now gone through one simulation and learned
-//     from it.  Repeat again from bz_newchain() over and over until your
+//     from it.  Repeat again from bz_zerochain() over and over until your
 //     brain is close enough to perfect for your needs.
 //
 //     An exammple:  For tic-tac-toe, there are 3^9 possible boards (we
@@ -238,10 +260,105 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
 #include "bzerker.h"
 
 int bz_tracemode = 0;
 
+//   Trace messages only exist in builds with BZ_TRACING defined (the
+//   debug profile); otherwise they compile away to nothing, so release
+//   builds don't even test bz_tracemode on the way through.
+#ifdef BZ_TRACING
+#define BZ_TRACE(...) \
+  do { if (bz_tracemode) { fprintf (stderr, "%s", BZ_TRACEPREFIX); \
+      fprintf (stderr, __VA_ARGS__); } } while (0)
+#else
+#define BZ_TRACE(...) do { } while (0)
+#endif
+
+//   Counters for shared brains.   If every worker bumped brain->counters
+//   they'd all be fighting over that one cache line on every decision,
+//   so a shared brain gets BZ__COUNTSLOTS sets, a cache line each, and
+//   each thread sticks to its own (handed out the first time it counts
+//   anything).   bz_getcounters adds them up.   The adds stay atomic, as
+//   a thread pool bigger than the slots makes threads double up.
+#define BZ__COUNTSLOTS 64
+struct bz__countslot {
+  bz_counters c;
+} __attribute__ ((aligned (64)));
+
+static __thread int bz__myslot = -1;
+static int bz__slotsgiven = 0;
+
+static inline bz_counters *bz__slotcounters (bz_brain *brain) {
+  if (bz__myslot < 0)
+    bz__myslot = __atomic_fetch_add (&bz__slotsgiven, 1, __ATOMIC_RELAXED)
+      % BZ__COUNTSLOTS;
+  return (&brain->countslots[bz__myslot].c);
+}
+
+//   Bump a brain counter: a plain increment for a brain only one thread
+//   uses, an atomic add on this thread's slot for a shared one.
+#define BZ__COUNT(brain, field, n)					\
+  do { if ((brain)->countslots)						\
+      __atomic_fetch_add (&bz__slotcounters (brain)->field, (n),		\
+			  __ATOMIC_RELAXED);				\
+    else (brain)->counters.field += (n); } while (0)
+
+//   ... and note a chain's length, for the longest-chain counter.
+#define BZ__MAXCHAIN(brain, n)						\
+  do { bz_counters *c_ = (brain)->countslots				\
+      ? bz__slotcounters (brain) : &(brain)->counters;			\
+    if ((uint64_t) (n) > __atomic_load_n (&c_->maxchain, __ATOMIC_RELAXED)) \
+      __atomic_store_n (&c_->maxchain, (n), __ATOMIC_RELAXED); } while (0)
+
+//   Seeds handed to new brains.   Each new brain gets the next one, so
+//   two brains made back-to-back don't play identical games.
+//   (Bumped atomically: sweeps make brains on several threads at once.)
+static unsigned long bz__seedbase = 1;
+static unsigned long bz__seedcount = 0;
+
+//    Striped row locks.   Rather than a mutex per state (20K of them for
+//    tic-tac-toe) or one for the whole brain (which would serialize
+//    everything) we hash each state row onto one of a few hundred locks.
+struct bz__locks {
+  int count;
+  pthread_mutex_t *mutexes;
+};
+
+//    The inference cache: for each state, the running sum of its action
+//    weights, plus the mask it was built for and whether it's current.
+struct bz__infer {
+  float evse;
+  float *cdf;           //  maxstates * maxactions running sums
+  bz_maskword *masks;   //  maxstates * BZ_MASKWORDS(maxactions)
+  char *valid;          //  per state: nonzero if cdf row is up to date
+};
+
+//    A dirty-row bitmap, one bit per state, set whenever a row's tokens
+//    change.   A brain can have several (each user clears its own).
+struct bz__tracker {
+  uint64_t *bits;
+  struct bz__tracker *next;
+};
+
+//    A factored brain's pieces: factor i is a dense brain of sizes[i]
+//    states, and is the i'th digit of the (mixed-radix) state.
+struct bz__factors {
+  int count;
+  int shared;      //  bz_sharebrain'd (the factors lock; count atomically)
+  long *sizes;
+  bz_brain **brains;
+};
+
 ////////////////////////////////////////////////////////////////////////
 //
 //      The functions to implement BOXES 
@@ -250,33 +367,273 @@ int bz_tracemode = 0;
 
 //       initialize?    Nothing here yet.
 void bz_init () {
-  if (bz_tracemode) {
-    fprintf (stderr, "%s%s", BZ_TRACEPREFIX, "Initialization called\n"); 
-  }
+  BZ_TRACE ("Initialization called\n");
 }
 
 char *bz_version () {
-  if (bz_tracemode) {
-    fprintf (stderr, "%s%s", BZ_TRACEPREFIX, "Version string requested\n"); 
-  }
+  BZ_TRACE ("Version string requested\n");
   return BZ_TRACEPREFIX;
 }
 
-char *bz_status () {
-    if (bz_tracemode) {
-    fprintf (stderr, "%s%s", BZ_TRACEPREFIX, "Status called\n"); 
+//       What's this brain been up to?   Returns a malloc'd line of the
+//       counters (caller frees it), or NULL if there's no memory.
+char *bz_status (bz_brain *brain) {
+  char *status;
+  bz_counters c;
+  BZ_TRACE ("Status called\n");
+  status = malloc (256);
+  if (status == NULL) return (NULL);
+  bz_getcounters (brain, &c);
+  snprintf (status, 256,
+	    "decisions %llu underflows %llu (%.4f%%) learns %llu clamps %llu"
+	    " chains %llu avglen %.2f maxlen %llu",
+	    (unsigned long long) c.decisions,
+	    (unsigned long long) c.underflows,
+	    c.decisions ? 100.0 * c.underflows / c.decisions : 0.0,
+	    (unsigned long long) c.learns,
+	    (unsigned long long) c.clamps,
+	    (unsigned long long) c.chains,
+	    c.chains ? (double) c.chainlinks / c.chains : 0.0,
+	    (unsigned long long) c.maxchain);
+  return (status);
+}
+
+//       A shared brain's counters are spread over its slots (see
+//       BZ__COUNTSLOTS); add them up.
+void bz_getcounters (bz_brain *brain, bz_counters *c) {
+  bz_counters *slot;
+  int i;
+  *c = brain->counters;
+  if (brain->countslots == NULL) return;
+  for (i = 0; i < BZ__COUNTSLOTS; i++) {
+    slot = &brain->countslots[i].c;
+    c->decisions += __atomic_load_n (&slot->decisions, __ATOMIC_RELAXED);
+    c->underflows += __atomic_load_n (&slot->underflows, __ATOMIC_RELAXED);
+    c->learns += __atomic_load_n (&slot->learns, __ATOMIC_RELAXED);
+    c->clamps += __atomic_load_n (&slot->clamps, __ATOMIC_RELAXED);
+    c->chains += __atomic_load_n (&slot->chains, __ATOMIC_RELAXED);
+    c->chainlinks += __atomic_load_n (&slot->chainlinks, __ATOMIC_RELAXED);
+    if (__atomic_load_n (&slot->maxchain, __ATOMIC_RELAXED) > c->maxchain)
+      c->maxchain = __atomic_load_n (&slot->maxchain, __ATOMIC_RELAXED);
+  }
+}
+
+//       Start counting over (say, at the top of a new batch of games).
+void bz_resetcounters (bz_brain *brain) {
+  memset (&brain->counters, 0, sizeof (brain->counters));
+  if (brain->countslots)
+    memset (brain->countslots, 0,
+	    sizeof (struct bz__countslot) * BZ__COUNTSLOTS);
+}
+
+//       Give a brain that's being shared its per-thread counter slots,
+//       carrying over what it's counted so far.   Returns 0 on success.
+static int bz__sharecounters (bz_brain *brain) {
+  if (brain->countslots) return (0);
+  if (posix_memalign ((void **) &brain->countslots, 64,
+		      sizeof (struct bz__countslot) * BZ__COUNTSLOTS)) {
+    brain->countslots = NULL;
+    return (1);
+  }
+  memset (brain->countslots, 0,
+	  sizeof (struct bz__countslot) * BZ__COUNTSLOTS);
+  return (0);
+}
+
+//    Hashed (sparse) brains.   An open-addressed, linear-probed table
+//    of state keys, with each key's row of tokens in a parallel array.
+//    It doubles when it gets 70% full, so rows DO move; nobody may hold
+//    onto a row pointer across anything that might add a state.
+#define BZ__NOKEY (~(uint64_t) 0)
+
+struct bz__hash {
+  long capacity;        //  always a power of two
+  long count;
+  int mapped;           //  keys/rows point into an mmap'd snapshot
+  uint64_t *keys;       //  BZ__NOKEY marks an empty slot
+  float *rows;          //  capacity * maxactions tokens
+};
+
+static inline uint64_t bz__hashkey (uint64_t x) {
+  //   splitmix64's finalizer - consecutive states scatter nicely
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  return (x ^ (x >> 31));
+}
+
+static int bz__hashalloc (bz_brain *brain, struct bz__hash *h, long capacity) {
+  long i;
+  h->capacity = capacity;
+  h->count = 0;
+  h->mapped = 0;
+  h->keys = malloc (sizeof (uint64_t) * capacity);
+  h->rows = malloc (sizeof (float) * capacity * brain->maxactions);
+  if (h->keys == NULL || h->rows == NULL) {
+    free (h->keys);
+    free (h->rows);
+    return (1);
+  }
+  for (i = 0; i < capacity; i++) h->keys[i] = BZ__NOKEY;
+  return (0);
+}
+
+static int bz__newhash (bz_brain *brain, long expected) {
+  struct bz__hash *h;
+  long capacity;
+  capacity = 64;
+  while (capacity * 7 < expected * 10) capacity *= 2;
+  h = malloc (sizeof (struct bz__hash));
+  if (h == NULL || bz__hashalloc (brain, h, capacity)) {
+    free (h);
+    return (1);
+  }
+  brain->hash = h;
+  return (0);
+}
+
+//    Find the slot holding key, or the empty slot where it would go.
+static inline long bz__hashslot (struct bz__hash *h, uint64_t key) {
+  long slot;
+  slot = bz__hashkey (key) & (h->capacity - 1);
+  while (h->keys[slot] != key && h->keys[slot] != BZ__NOKEY)
+    slot = (slot + 1) & (h->capacity - 1);
+  return (slot);
+}
+
+static int bz__hashgrow (bz_brain *brain) {
+  struct bz__hash *h, bigger;
+  long i, slot;
+  h = brain->hash;
+  if (bz__hashalloc (brain, &bigger, h->capacity * 2)) return (1);
+  for (i = 0; i < h->capacity; i++) {
+    if (h->keys[i] == BZ__NOKEY) continue;
+    slot = bz__hashslot (&bigger, h->keys[i]);
+    bigger.keys[slot] = h->keys[i];
+    memcpy (&bigger.rows[slot * brain->maxactions],
+	    &h->rows[i * brain->maxactions],
+	    sizeof (float) * brain->maxactions);
+  }
+  bigger.count = h->count;
+  if ( ! h->mapped) {
+    free (h->keys);
+    free (h->rows);
+  }
+  *h = bigger;
+  return (0);
+}
+
+//    The row of tokens for a state - making it if this is a new state.
+static float *bz__hashrow (bz_brain *brain, uint64_t key) {
+  struct bz__hash *h;
+  long slot;
+  int i;
+  float *row;
+  h = brain->hash;
+  if (key == BZ__NOKEY) key--;   //  the one key we can't store; fold it
+  slot = bz__hashslot (h, key);
+  if (h->keys[slot] == key)
+    return (&h->rows[slot * brain->maxactions]);
+  //   a new state.  Make room first if we're getting crowded.
+  if ((h->count + 1) * 10 > h->capacity * 7) {
+    if (bz__hashgrow (brain)) {
+      fprintf (stderr, "BZERKER - out of memory growing a hashed brain.\n");
+      exit (1);
+    }
+    slot = bz__hashslot (h, key);
+  }
+  h->keys[slot] = key;
+  h->count++;
+  row = &h->rows[slot * brain->maxactions];
+  for (i = 0; i < brain->maxactions; i++) row[i] = brain->starting_tokens;
+  return (row);
+}
+
+//    Compact brains store each row as uint16 counts times one float
+//    scale per row, scaled so the row's biggest box is 65535.  That's
+//    better than 1 part in 65000 of the row's leader, which is plenty
+//    for add-0.01-tokens learning.   A zero count means exactly
+//    TOKENMIN, so the "box ran dry" logic sees what it always saw; any
+//    other positive value never rounds down below one count.
+static void bz__encoderow (bz_brain *brain, long state, const float *row) {
+  uint16_t *q;
+  float biggest, scale, inv;
+  long v;
+  int i;
+  q = &brain->qstates[(long) brain->maxactions * state];
+  biggest = 0;
+  for (i = 0; i < brain->maxactions; i++)
+    if (row[i] > biggest) biggest = row[i];
+  scale = (biggest > 0) ? biggest / 65535.0f : 1.0f;
+  inv = 1.0f / scale;
+  for (i = 0; i < brain->maxactions; i++) {
+    if (row[i] <= TOKENMIN) {
+      q[i] = 0;
+      continue;
+    }
+    v = (long) (row[i] * inv + 0.5f);
+    q[i] = v < 1 ? 1 : (v > 65535 ? 65535 : v);
+  }
+  brain->scales[state] = scale;
+}
+
+static void bz__decoderow (bz_brain *brain, long state, float *row) {
+  uint16_t *q;
+  float scale;
+  int i;
+  q = &brain->qstates[(long) brain->maxactions * state];
+  scale = brain->scales[state];
+  for (i = 0; i < brain->maxactions; i++)
+    row[i] = q[i] ? q[i] * scale : TOKENMIN;
+}
+
+static float *bz__factorrow (bz_brain *brain, long state, float *scratch);
+
+//    Every read or write of a brain's tokens goes through here.  For
+//    float brains you get the real row; compact brains unpack the row
+//    into "scratch" (maxactions floats) and you get that, so anybody
+//    who changes the row must hand it back with bz__rowdone.   Factored
+//    brains add up their factors' rows into scratch, and that's only
+//    for reading (learning and refills go to the factors themselves).
+static inline float *bz__row (bz_brain *brain, long state, float *scratch) {
+  if (brain->hash) return (bz__hashrow (brain, (uint64_t) state));
+  if (brain->qstates) {
+    bz__decoderow (brain, state, scratch);
+    return (scratch);
   }
+  if (brain->factors) return (bz__factorrow (brain, state, scratch));
+  return (&brain->states[(long) brain->rowstride * state]);
+}
 
+static inline void bz__rowdone (bz_brain *brain, long state, float *row) {
+  if (brain->qstates) bz__encoderow (brain, state, row);
 }
+
+//    Fill "rows" rows of "stride" floats: the first "actions" of each get
+//    "tokens", any padding gets 0.   One row is built by hand and then
+//    copied in ever-bigger memcpy's, which is much quicker than a box at
+//    a time.
+static void bz__fillrows (float *base, long rows, int actions, int stride,
+			  float tokens) {
+  long done, n;
+  int i;
+  if (rows <= 0) return;
+  for (i = 0; i < stride; i++) base[i] = (i < actions) ? tokens : 0;
+  for (done = 1; done < rows; done += n) {
+    n = (done < rows - done) ? done : rows - done;
+    memcpy (&base[done * stride], base, sizeof (float) * stride * n);
+  }
+}
+
 bz_brain *bz_newbrain (	     int braintype,
 			     int max_states,
 			     int max_actions,
 			     int tokens_per_node)
 {
-  if (bz_tracemode) {
-    fprintf (stderr, "%s%s", BZ_TRACEPREFIX, "newbrain_quant called\n");
-  }
-  if (braintype != BZ_BRAIN_QUANTIZED)  {
+  BZ_TRACE ("newbrain_quant called\n");
+  if (braintype != BZ_BRAIN_QUANTIZED && braintype != BZ_BRAIN_HASHED
+      && braintype != BZ_BRAIN_COMPACT)  {
     fprintf (stderr, "BZERKER - no such brain type.\n");
     exit (1);
   }
@@ -284,153 +641,1192 @@ bz_brain *bz_newbrain (	     int braintype,
   bz_brain *my_brain;
   my_brain = (bz_brain *) (malloc (sizeof (bz_brain)));
   //    Fill in the slots of the brain:
-  my_brain->braintype = 0;    //  discrete brain
+  my_brain->braintype = braintype;
   my_brain->maxstates = max_states;
   my_brain->maxactions = max_actions;
   my_brain->starting_tokens = tokens_per_node;  //  Used during out-of-token refills
+  my_brain->rowstride = max_actions;
+  bz_rng_seed (&my_brain->rng, bz__seedbase
+	       + __atomic_fetch_add (&bz__seedcount, 1, __ATOMIC_RELAXED));
+  memset (&my_brain->counters, 0, sizeof (my_brain->counters));
+  my_brain->locks = NULL;
+  my_brain->countslots = NULL;
+  my_brain->infer = NULL;
+  my_brain->factors = NULL;
+  my_brain->trackers = NULL;
+  my_brain->hash = NULL;
+  my_brain->mapbase = NULL;
+  my_brain->maplen = 0;
+  my_brain->qstates = NULL;
+  my_brain->scales = NULL;
+  if (braintype == BZ_BRAIN_COMPACT) {
+    //    Dense, but at 16 bits a box plus a float a state.
+    int istate, iaction;
+    float fullrow[max_actions];
+    my_brain->states = NULL;
+    my_brain->qstates = malloc (sizeof (uint16_t) * max_states * max_actions);
+    my_brain->scales = malloc (sizeof (float) * max_states);
+    if (my_brain->qstates == NULL || my_brain->scales == NULL) {
+      fprintf (stderr, "BZERKER - out of memory making a compact brain.\n");
+      exit (1);
+    }
+    for (iaction = 0; iaction < max_actions; iaction++)
+      fullrow[iaction] = tokens_per_node;
+    for (istate = 0; istate < max_states; istate++)
+      bz__encoderow (my_brain, istate, fullrow);
+    return (my_brain);
+  }
+  if (braintype == BZ_BRAIN_HASHED) {
+    //    Sparse brain: no dense array at all, rows made on demand.
+    my_brain->states = NULL;
+    if (bz__newhash (my_brain, max_states)) {
+      fprintf (stderr, "BZERKER - out of memory making a hashed brain.\n");
+      exit (1);
+    }
+    return (my_brain);
+  }
   //    Make the boxes array (which is an array of ints)
   my_brain->states= (float *) malloc(sizeof(float) * max_states * max_actions);
+  if (my_brain->states == NULL) {
+    fprintf (stderr, "BZERKER - out of memory making a brain.\n");
+    exit (1);
+  }
   //    Now fill in the boxes.   This is a dense, discrete brain.
-  //     Sparse brains will come later, if ever.
-  int istate, iaction;
-  //    Enumerate each of the allowed states, and init the boxes in each
-  for (istate = 0; istate < max_states; istate++) {
-    for (iaction = 0; iaction < max_actions; iaction++) {
-      my_brain->states[istate * max_actions + iaction] = tokens_per_node;
+  //     (Sparse brains are BZ_BRAIN_HASHED, above.)
+  bz__fillrows (my_brain->states, max_states, max_actions, max_actions,
+		tokens_per_node);
+  return (my_brain);
+}
+
+//    Floats per padded row: rows of up to 16 actions round up to a power
+//    of two (so they never straddle a 64-byte line), bigger ones to a
+//    whole number of lines.
+static int bz__padstride (int actions) {
+  int stride;
+  if (actions > 16) return ((actions + 15) & ~15);
+  for (stride = 1; stride < actions; stride *= 2) ;
+  return (stride);
+}
+
+//    Big brains get their own mapping, on huge pages if the system has
+//    any to spare (or transparent ones if not), so random rows don't
+//    cost a TLB miss each.
+#define BZ__HUGEPAGE (2L * 1024 * 1024)
+
+struct bz__filler {
+  float *base;
+  long rows;
+  int actions, stride;
+  float tokens;
+  int threaded;
+  pthread_t thread;
+};
+
+static void *bz__fillthread (void *arg) {
+  struct bz__filler *f = arg;
+  bz__fillrows (f->base, f->rows, f->actions, f->stride, f->tokens);
+  return (NULL);
+}
+
+bz_brain *bz_newbrain_padded (int max_states, int max_actions,
+			      int tokens_per_node, int flags) {
+  bz_brain *my_brain;
+  long len;
+  void *base;
+  BZ_TRACE ("newbrain_padded called\n");
+  my_brain = bz_newbrain (BZ_BRAIN_QUANTIZED, 1, max_actions,
+			  tokens_per_node);
+  free (my_brain->states);
+  my_brain->maxstates = max_states;
+  my_brain->rowstride = bz__padstride (max_actions);
+  len = sizeof (float) * (long) max_states * my_brain->rowstride;
+  base = NULL;
+  if ((flags & BZ_ALLOC_HUGEPAGES) && len >= BZ__HUGEPAGE) {
+    long maplen = (len + BZ__HUGEPAGE - 1) & ~(BZ__HUGEPAGE - 1);
+#ifdef MAP_HUGETLB
+    base = mmap (NULL, maplen, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (base == MAP_FAILED) base = NULL;
+#endif
+    if (base == NULL) {
+      base = mmap (NULL, maplen, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (base == MAP_FAILED) base = NULL;
+#ifdef MADV_HUGEPAGE
+      if (base) madvise (base, maplen, MADV_HUGEPAGE);
+#endif
+    }
+    if (base) {
+      my_brain->mapbase = base;
+      my_brain->maplen = maplen;
+    }
+  }
+  if (base == NULL && posix_memalign (&base, 64, len ? len : 64) != 0) {
+    fprintf (stderr, "BZERKER - out of memory making a padded brain.\n");
+    exit (1);
+  }
+  my_brain->states = base;
+  if (flags & BZ_ALLOC_PARALLELINIT) {
+    //   Each thread's pages get first touched by that thread, which is
+    //   what places them on a NUMA machine.
+    long nthreads, per, i;
+    nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > 64) nthreads = 64;
+    struct bz__filler fills[nthreads];
+    per = (max_states + nthreads - 1) / nthreads;
+    for (i = 0; i < nthreads; i++) {
+      fills[i].base = &my_brain->states[i * per * my_brain->rowstride];
+      fills[i].rows = (i * per >= max_states) ? 0
+	: (max_states - i * per < per) ? max_states - i * per : per;
+      fills[i].actions = max_actions;
+      fills[i].stride = my_brain->rowstride;
+      fills[i].tokens = tokens_per_node;
+      fills[i].threaded = i > 0
+	&& pthread_create (&fills[i].thread, NULL, bz__fillthread,
+			   &fills[i]) == 0;
+      if (i > 0 && ! fills[i].threaded)
+	bz__fillthread (&fills[i]);    //  no thread? do it ourselves
     }
+    bz__fillthread (&fills[0]);
+    for (i = 1; i < nthreads; i++)
+      if (fills[i].threaded) pthread_join (fills[i].thread, NULL);
+  } else {
+    bz__fillrows (my_brain->states, max_states, max_actions,
+		  my_brain->rowstride, tokens_per_node);
   }
   return (my_brain);
 }
 
+//    Give a brain a new, known random stream (for reproducible runs).
+void bz_seedbrain (bz_brain *brain, unsigned long seed) {
+  bz_rng_seed (&brain->rng, seed);
+}
+
 //    free() a brain, including all of the nested boxes, back into
 //    free memory....  Because there's pointer chasing involved, we
 //    can't just free(brain), but have to free() the stuff from the
 //    bottom up.
 int bz_killbrain (bz_brain *brain)
 {
-  if (bz_tracemode) {
-    fprintf (stderr, "%s%s", BZ_TRACEPREFIX, "killbrain called\n"); 
+  BZ_TRACE ("killbrain called\n");
+  if (brain->locks) {
+    int i;
+    for (i = 0; i < brain->locks->count; i++)
+      pthread_mutex_destroy (&brain->locks->mutexes[i]);
+    free (brain->locks->mutexes);
+    free (brain->locks);
+  }
+  free (brain->countslots);
+  if (brain->infer) {
+    free (brain->infer->cdf);
+    free (brain->infer->masks);
+    free (brain->infer->valid);
+    free (brain->infer);
+  }
+  if (brain->factors) {
+    int i;
+    for (i = 0; i < brain->factors->count; i++)
+      bz_killbrain (brain->factors->brains[i]);
+    free (brain->factors->brains);
+    free (brain->factors->sizes);
+    free (brain->factors);
+  }
+  if (brain->hash) {
+    if ( ! brain->hash->mapped) {
+      free (brain->hash->keys);
+      free (brain->hash->rows);
+    }
+    free (brain->hash);
+  }
+  if (brain->mapbase) {
+    munmap (brain->mapbase, brain->maplen);
+  } else {
+    free (brain->states);
+    free (brain->qstates);
+    free (brain->scales);
   }
-  free (brain->states);
   free (brain);
 }
 
+long bz_brainrows (bz_brain *brain) {
+  if (brain->hash) return (brain->hash->count);
+  if (brain->factors) {
+    long rows;
+    int i;
+    rows = 0;
+    for (i = 0; i < brain->factors->count; i++)
+      rows += brain->factors->sizes[i];
+    return (rows);
+  }
+  return (brain->maxstates);
+}
+
+int bz_sharebrain (bz_brain *brain, int stripes) {
+  int i;
+  struct bz__locks *locks;
+  BZ_TRACE ("sharebrain called\n");
+  if (brain->locks) return (0);   //  already shared
+  if (brain->factors) {
+    //   the rows that matter are the factors'; they lock, we don't
+    for (i = 0; i < brain->factors->count; i++)
+      if (bz_sharebrain (brain->factors->brains[i], stripes)) return (1);
+    brain->factors->shared = 1;
+    //   (but the pooled decisions are counted up here)
+    return (bz__sharecounters (brain));
+  }
+  if (brain->hash) {
+    //   a hashed brain can rehash under a reader's feet; not shareable
+    fprintf (stderr, "BZERKER - hashed brains can't be shared yet.\n");
+    return (1);
+  }
+  if (stripes < 1) stripes = 1;
+  if (bz__sharecounters (brain)) return (1);
+  locks = malloc (sizeof (struct bz__locks));
+  if (locks == NULL) return (1);
+  locks->mutexes = malloc (sizeof (pthread_mutex_t) * stripes);
+  if (locks->mutexes == NULL) {
+    free (locks);
+    return (1);
+  }
+  locks->count = stripes;
+  for (i = 0; i < stripes; i++)
+    pthread_mutex_init (&locks->mutexes[i], NULL);
+  brain->locks = locks;
+  return (0);
+}
+
+//    Somebody is about to change this row's tokens: tell every dirty-row
+//    tracker except "skip" (see bz_newsync).
+static inline void bz__marktrackers (bz_brain *brain, long state,
+				     struct bz__tracker *skip) {
+  struct bz__tracker *t;
+  uint64_t bit;
+  bit = ((uint64_t) 1) << (state % 64);
+  for (t = brain->trackers; t; t = t->next) {
+    if (t == skip) continue;
+    if (brain->locks)
+      __atomic_fetch_or (&t->bits[state / 64], bit, __ATOMIC_RELAXED);
+    else
+      t->bits[state / 64] |= bit;
+  }
+}
+
+//    ... and the same, plus the inference cache's copy is stale now.
+static inline void bz__invalidate (bz_brain *brain, long state) {
+  if (brain->infer) brain->infer->valid[state] = 0;
+  if (brain->trackers) bz__marktrackers (brain, state, NULL);
+}
+
+static inline void bz__lockrow (bz_brain *brain, long state) {
+  if (brain->locks)
+    pthread_mutex_lock (&brain->locks->mutexes[(unsigned long) state
+					      % brain->locks->count]);
+}
+
+static inline void bz__unlockrow (bz_brain *brain, long state) {
+  if (brain->locks)
+    pthread_mutex_unlock (&brain->locks->mutexes[(unsigned long) state
+						% brain->locks->count]);
+}
+
+//    Factored brains.   Each factor is an ordinary dense brain; the
+//    state's digits (lowest first) say which row of each factor to use.
+bz_brain *bz_newbrain_factored (int nfactors, const long *factor_states,
+				int max_actions, int tokens_per_node) {
+  bz_brain *my_brain;
+  struct bz__factors *f;
+  long product;
+  int i;
+  BZ_TRACE ("newbrain_factored called\n");
+  if (nfactors < 1) {
+    fprintf (stderr, "BZERKER - a factored brain needs at least one factor.\n");
+    return (NULL);
+  }
+  for (i = 0; i < nfactors; i++)
+    if (factor_states[i] < 1 || factor_states[i] > MAXINT) {
+      fprintf (stderr, "BZERKER - factor %d has an impossible size %ld.\n",
+	       i, factor_states[i]);
+      return (NULL);
+    }
+  //   a header with no rows of its own; the pooled row starts with
+  //   nfactors * tokens_per_node tokens, which is what a refill gives
+  my_brain = bz_newbrain (BZ_BRAIN_QUANTIZED, 1, max_actions,
+			  nfactors * tokens_per_node);
+  free (my_brain->states);
+  my_brain->states = NULL;
+  my_brain->braintype = BZ_BRAIN_FACTORED;
+  f = malloc (sizeof (struct bz__factors));
+  if (f) {
+    f->sizes = malloc (sizeof (long) * nfactors);
+    f->brains = malloc (sizeof (bz_brain *) * nfactors);
+  }
+  if (f == NULL || f->sizes == NULL || f->brains == NULL) {
+    fprintf (stderr, "BZERKER - out of memory making a factored brain.\n");
+    exit (1);
+  }
+  f->count = nfactors;
+  f->shared = 0;
+  product = 1;
+  for (i = 0; i < nfactors; i++) {
+    f->sizes[i] = factor_states[i];
+    f->brains[i] = bz_newbrain (BZ_BRAIN_QUANTIZED, factor_states[i],
+				max_actions, tokens_per_node);
+    //   (only the range check in bz_addtochain looks at this)
+    if (product <= MAXINT) product *= factor_states[i];
+  }
+  my_brain->maxstates = product > MAXINT ? MAXINT : product;
+  my_brain->factors = f;
+  return (my_brain);
+}
+
+long bz_factorstate (bz_brain *brain, const long *substates) {
+  long state;
+  int i;
+  state = 0;
+  for (i = brain->factors->count - 1; i >= 0; i--)
+    state = state * brain->factors->sizes[i] + substates[i];
+  return (state);
+}
+
+//    The pooled row: each factor's row, locked just long enough to add
+//    it in if the factors are shared.
+static float *bz__factorrow (bz_brain *brain, long state, float *scratch) {
+  struct bz__factors *f;
+  bz_brain *fb;
+  float *row;
+  long s;
+  int i, a;
+  f = brain->factors;
+  for (a = 0; a < brain->maxactions; a++) scratch[a] = 0;
+  for (i = 0; i < f->count; i++) {
+    fb = f->brains[i];
+    s = state % f->sizes[i];
+    state /= f->sizes[i];
+    row = &fb->states[(long) fb->rowstride * s];
+    bz__lockrow (fb, s);
+    for (a = 0; a < brain->maxactions; a++) scratch[a] += row[a];
+    bz__unlockrow (fb, s);
+  }
+  return (scratch);
+}
+
+//    Gambler's ruin on a factored brain refills the legal boxes of every
+//    factor's row.
+static void bz__factorrefill (bz_brain *brain, long state, const int *legal,
+			      int nlegal) {
+  struct bz__factors *f;
+  bz_brain *fb;
+  float *row;
+  long s;
+  int i, a;
+  f = brain->factors;
+  for (i = 0; i < f->count; i++) {
+    fb = f->brains[i];
+    s = state % f->sizes[i];
+    state /= f->sizes[i];
+    row = &fb->states[(long) fb->rowstride * s];
+    bz__lockrow (fb, s);
+    for (a = 0; a < nlegal; a++) row[legal[a]] = fb->starting_tokens;
+    bz__unlockrow (fb, s);
+  }
+}
+
 //
 //       The core of the algorithm- given a set of boxes (the "brain"), and
 //       a current state, pick an action randomly! 
 long bz_nextaction (
 		     bz_brain *brain,
-		     int cur_state,
+		     long cur_state,
 		     float *evse,
 		     char *mask,
 		     int *underflows
 		     )
 {
-  if (bz_tracemode) {
-    fprintf (stderr, "%s%s", BZ_TRACEPREFIX, "next_action called\n"); 
+  return (bz_nextaction_r (brain, &brain->rng, cur_state, evse, mask,
+			   underflows));
+}
+
+static long bz__pick (bz_brain *brain, bz_rng *rng, long cur_state,
+		      float *evse, const int *legal, int nlegal,
+		      int *underflows);
+
+//       Fixed action count kernels (see bz__pickfixed below).   They take
+//       the legal set as one bitmask word.   bz__kernelfor says whether
+//       this brain has one (its action count, or 0 to go the general
+//       way), and bz__pickn calls it.
+static int bz__kernelfor (bz_brain *brain);
+static long bz__pickn (bz_brain *brain, bz_rng *rng, long cur_state,
+		       float *evse, bz_maskword legal, int *underflows);
+#define BZ__ALLLEGAL(n) ((((bz_maskword) 1) << (n)) - 1)
+
+//       Turn a char mask (>=0 is allowed) into the list of legal actions.
+static int bz__legalfrommask (bz_brain *brain, char *mask, int *legal) {
+  int i, n;
+  n = 0;
+  //   hidden assumption that mask is "long enough".  Otherwise,
+  //   we'll be sucking mud because C doesn't usually check subscripts.
+  for (i = 0; i < brain->maxactions; i++)
+    if (mask == NULL || mask[i] >= 0) legal[n++] = i;
+  return (n);
+}
+
+//       Same thing from a packed bitmask - only visits the set bits.
+static int bz__legalfrombits (bz_brain *brain, const bz_maskword *bits,
+			      int *legal) {
+  int w, n, words;
+  bz_maskword word;
+  n = 0;
+  words = BZ_MASKWORDS (brain->maxactions);
+  for (w = 0; w < words; w++) {
+    word = bits[w];
+    if (w == words - 1 && (brain->maxactions & 63))
+      word &= (((bz_maskword) 1) << (brain->maxactions & 63)) - 1;
+    while (word) {
+      legal[n++] = w * 64 + __builtin_ctzll (word);
+      word &= word - 1;
+    }
+  }
+  return (n);
+}
+
+//       Reentrant version - the caller owns the random stream.
+long bz_nextaction_r (
+		       bz_brain *brain,
+		       bz_rng *rng,
+		       long cur_state,
+		       float *evse,
+		       char *mask,
+		       int *underflows
+		       )
+{
+  long action;
+  int legal[brain->maxactions];
+  int nlegal;
+  BZ_TRACE ("next_action called\n");
+  if (bz__kernelfor (brain)) {
+    bz_maskword bits;
+    int i;
+    bits = BZ__ALLLEGAL (brain->maxactions);
+    if (mask)
+      for (i = 0; i < brain->maxactions; i++)
+	bits &= ~(((bz_maskword) (mask[i] < 0)) << i);
+    bz__lockrow (brain, cur_state);
+    action = bz__pickn (brain, rng, cur_state, evse, bits, underflows);
+    bz__unlockrow (brain, cur_state);
+    return (action);
+  }
+  nlegal = bz__legalfrommask (brain, mask, legal);
+  bz__lockrow (brain, cur_state);
+  action = bz__pick (brain, rng, cur_state, evse, legal, nlegal, underflows);
+  bz__unlockrow (brain, cur_state);
+  return (action);
+}
+
+//       Bitmask version: bit i of legal[] set means action i is allowed.
+long bz_nextaction_bits (
+			  bz_brain *brain,
+			  bz_rng *rng,
+			  long cur_state,
+			  float *evse,
+			  const bz_maskword *legalbits,
+			  int *underflows
+			  )
+{
+  long action;
+  int legal[brain->maxactions];
+  int nlegal;
+  BZ_TRACE ("next_action_bits called\n");
+  if (rng == NULL) rng = &brain->rng;
+  if (bz__kernelfor (brain)) {
+    bz__lockrow (brain, cur_state);
+    action = bz__pickn (brain, rng, cur_state, evse,
+			BZ__ALLLEGAL (brain->maxactions)
+			& (legalbits ? legalbits[0] : ~(bz_maskword) 0),
+			underflows);
+    bz__unlockrow (brain, cur_state);
+    return (action);
+  }
+  if (legalbits)
+    nlegal = bz__legalfrombits (brain, legalbits, legal);
+  else
+    nlegal = bz__legalfrommask (brain, NULL, legal);
+  bz__lockrow (brain, cur_state);
+  action = bz__pick (brain, rng, cur_state, evse, legal, nlegal, underflows);
+  bz__unlockrow (brain, cur_state);
+  return (action);
+}
+
+//       Pull a state's row toward the cache ahead of use.   Rows can
+//       straddle cache lines, so touch both ends.   (Hashed rows aren't
+//       findable without probing, so they don't get this.)
+#define BZ__PREFETCHAHEAD 8
+static inline void bz__prefetchrow (bz_brain *brain, long state) {
+  if (brain->states) {
+    float *row = &brain->states[state * brain->rowstride];
+    __builtin_prefetch (row, 1);
+    __builtin_prefetch (row + brain->maxactions - 1, 1);
+  } else if (brain->qstates) {
+    uint16_t *q = &brain->qstates[state * brain->maxactions];
+    __builtin_prefetch (q, 1);
+    __builtin_prefetch (q + brain->maxactions - 1, 1);
+    __builtin_prefetch (&brain->scales[state], 1);
+  }
+}
+
+//       Batch version, for stepping lots of environments in lockstep:
+//       n states in, n actions out.   legalbits holds maskstride words
+//       per environment; maskstride 0 means everyone shares the first
+//       (and its legal list is only worked out once), NULL means all
+//       legal.   Rows are prefetched a few environments ahead, and the
+//       per-call setup is done once for the whole batch.   The picks
+//       are exactly what n calls to bz_nextaction_bits would give.
+int bz_nextaction_many (
+			bz_brain *brain,
+			bz_rng *rng,
+			int n,
+			const long *states,
+			float *evse,
+			const bz_maskword *legalbits,
+			int maskstride,
+			long *actions,
+			int *underflows
+			)
+{
+  int legal[brain->maxactions];
+  int nlegal, i;
+  BZ_TRACE ("next_action_many called\n");
+  if (rng == NULL) rng = &brain->rng;
+  if (bz__kernelfor (brain)) {
+    bz_maskword all, bits;
+    all = BZ__ALLLEGAL (brain->maxactions);
+    bits = legalbits ? legalbits[0] & all : all;
+    for (i = 0; i < n && i < BZ__PREFETCHAHEAD; i++)
+      bz__prefetchrow (brain, states[i]);
+    for (i = 0; i < n; i++) {
+      if (i + BZ__PREFETCHAHEAD < n)
+	bz__prefetchrow (brain, states[i + BZ__PREFETCHAHEAD]);
+      if (legalbits && maskstride)
+	bits = legalbits[(long) i * maskstride] & all;
+      bz__lockrow (brain, states[i]);
+      actions[i] = bz__pickn (brain, rng, states[i], evse, bits,
+			      underflows);
+      bz__unlockrow (brain, states[i]);
+    }
+    return (0);
+  }
+  nlegal = 0;
+  if (legalbits == NULL)
+    nlegal = bz__legalfrommask (brain, NULL, legal);
+  else if (maskstride == 0)
+    nlegal = bz__legalfrombits (brain, legalbits, legal);
+  for (i = 0; i < n && i < BZ__PREFETCHAHEAD; i++)
+    bz__prefetchrow (brain, states[i]);
+  for (i = 0; i < n; i++) {
+    if (i + BZ__PREFETCHAHEAD < n)
+      bz__prefetchrow (brain, states[i + BZ__PREFETCHAHEAD]);
+    if (legalbits && maskstride)
+      nlegal = bz__legalfrombits (brain, &legalbits[(long) i * maskstride],
+				  legal);
+    bz__lockrow (brain, states[i]);
+    actions[i] = bz__pick (brain, rng, states[i], evse, legal, nlegal,
+			   underflows);
+    bz__unlockrow (brain, states[i]);
+  }
+  return (0);
+}
+
+//       x to the power e, for the weights.   libm pow() used to be most
+//       of the time spent choosing; the common evse values are small
+//       integers (and the odd half), which are just a few multiplies.
+typedef struct bz__expo {
+  float e;
+  int kind;     //  0 = general, 1 = integer, 2 = integer + 1/2
+  int n;        //  |integer part|
+  int neg;      //  negative exponent => reciprocal at the end
+} bz__expo;
+
+static void bz__expo_init (bz__expo *ex, float e) {
+  float ae;
+  ex->e = e;
+  ex->neg = e < 0;
+  ae = ex->neg ? -e : e;
+  ex->n = (int) ae;
+  ex->kind = 0;
+  if (ae <= 64) {
+    if (ae == (float) ex->n) ex->kind = 1;
+    else if (ae - ex->n == 0.5f) ex->kind = 2;
+  }
+}
+
+static inline float bz__expo_pow (const bz__expo *ex, float x) {
+  float r, b;
+  int n;
+  if (ex->kind == 0) return (powf (x, ex->e));
+  r = (ex->kind == 2) ? sqrtf (x) : 1.0f;
+  b = x;
+  n = ex->n;
+  while (n) {
+    if (n & 1) r *= b;
+    b *= b;
+    n >>= 1;
   }
+  return (ex->neg ? 1.0f / r : r);
+}
+
+//       The actual choice, given the list of legal actions.   Both mask
+//       flavors end up here, so they give identical answers.  We walk
+//       the row once to pick up token counts, weight them once into a
+//       little stack buffer, and then choose from the buffer.
+static long bz__pick (
+		      bz_brain *brain,
+		      bz_rng *rng,
+		      long cur_state,
+		      float *evse,
+		      const int *legal,
+		      int nlegal,
+		      int *underflows
+		      )
+{
   //   Get a random number picking 1 of N actions...
   int myrandom, i;
   float sumup;
   sumup = 0;
   float sumup2;
   sumup2 = 0;
-  float expval;
+  float *row;
+  float rowbuf [brain->maxactions];
+  float weight [nlegal > 0 ? nlegal : 1];
+  bz__expo ex;
+  int ruined;
 
   int maxacts;
-  maxacts = 0;
-  for (i = 0; i < brain->maxactions; i++) {
-    if (mask == NULL || mask[i] >= 0) maxacts++;
-  }
+  maxacts = nlegal;
+  ruined = 0;
+  BZ__COUNT (brain, decisions, 1);
+  row = bz__row (brain, cur_state, rowbuf);
   
-  expval = (evse == NULL) ? 1.0 : *evse;
-  for (i = 0; i < brain->maxactions; i++) {
-    //   hidden assumption that mask is "long enough".  Otherwise,
-    //   we'll be sucking mud because C doesn't usually check subscripts.
-    //
-    if (mask == NULL || mask[i] >= 0) {
-      sumup += brain->states [brain->maxactions * cur_state + i];
-    }
-  }
-  if (evse) {
-    for (i = 0; i < brain->maxactions; i++) {
-      if (mask == NULL || mask[i] >= 0 ) {
-	sumup2 += pow ((brain->states[cur_state * brain->maxactions + i] /
-			(sumup / maxacts)),
-		       expval);  // always >= 0
-      }
-    }
+  for (i = 0; i < nlegal; i++) {
+    weight[i] = row[legal[i]];
+    sumup += weight[i];
   }
   //fprintf (stderr, "sumup: %f ", sumup);
   //
   //    Check for underflowing brain tokens here.
   ///    GROT GROT GROT Move this to LEARNING!
-  if (bz_tracemode) fprintf (stderr, " total tokens: %f ", sumup);
+  BZ_TRACE (" total tokens: %f ", sumup);
   if (sumup <= 1) {    ///   ARBITRARY CHOICE
     if (0) { printf (" UNDERFLOW "); fflush (stdout);};
     if (underflows) { (*underflows)++;}
-    for (i = 0; i < brain->maxactions; i++) {
-      if (mask == NULL || mask[i] >= 0)
-	brain->states[brain->maxactions * cur_state + i] =
-	  brain->starting_tokens;
+    BZ__COUNT (brain, underflows, 1);
+    ruined = 1;
+    bz__invalidate (brain, cur_state);
+    for (i = 0; i < nlegal; i++) {
+      row[legal[i]] = weight[i] = brain->starting_tokens;
     }
+    if (brain->factors) bz__factorrefill (brain, cur_state, legal, nlegal);
+    else bz__rowdone (brain, cur_state, row);
     sumup = brain->maxactions * brain->starting_tokens;
-    sumup2 = brain->maxactions;
   }
-  i = 0;
   if (evse) {
-    myrandom = bz__random (sumup2);
-    for (i = 0; i < brain->maxactions; i++) {
-      if (mask == NULL || mask[i] >= 0) {
-	myrandom -= pow (brain->states[brain->maxactions * cur_state + i] /
-			 (sumup / maxacts), expval);
-	if (myrandom <= 0) return (i);   
-      }
+    float inv_avg;
+    bz__expo_init (&ex, *evse);
+    inv_avg = maxacts / sumup;
+    for (i = 0; i < nlegal; i++) {
+      weight[i] = bz__expo_pow (&ex, weight[i] * inv_avg);  // always >= 0
+      sumup2 += weight[i];
     }
+    //   a refilled box draws against maxactions, as it always has
+    myrandom = bz__rng_random (rng, ruined ? brain->maxactions : sumup2);
   } else {
-    myrandom = bz__random (sumup);
-    for (i = 0; i < brain->maxactions; i++) {
-      if (mask == NULL || mask[i] >= 0) {
-	myrandom -= brain->states[brain->maxactions * cur_state + i];
-	if (myrandom <= 0) return (i);
+    myrandom = bz__rng_random (rng, sumup);
+  }
+  for (i = 0; i < nlegal; i++) {
+    myrandom -= weight[i];
+    if (myrandom <= 0) return (legal[i]);
+  }
+  return 0;
+}
+
+//       The same choice again, specialized for one action count.   Plain
+//       dense rows only (not compact, hashed or factored), and the legal
+//       set is a single bitmask word, so up to 63 actions.   With n a
+//       compile-time constant the row loops unroll, the row stride
+//       multiply is the only thing left over from the general version,
+//       and there's no legal list to build.   Illegal actions just get a
+//       weight of 0: adding or subtracting 0 changes nothing, so the
+//       sums (in the same order) and the pick come out bit-for-bit what
+//       bz__pick gives.   The row sum is branch-free (x * 1 is x, x * 0
+//       is 0 for any token count) and fully unrolled; the weighting and
+//       the choice only visit the set bits, like bz__legalfrombits does.
+static inline __attribute__ ((always_inline)) long bz__pickfixed (
+		      bz_brain *brain,
+		      bz_rng *rng,
+		      long cur_state,
+		      float *evse,
+		      bz_maskword legal,
+		      int *underflows,
+		      const int n
+		      )
+{
+  int myrandom, i, nlegal, ruined;
+  float sumup, sumup2, inv_avg;
+  float *row;
+  float weight [64];
+  bz_maskword b;
+  bz__expo ex;
+  BZ__COUNT (brain, decisions, 1);
+  row = &brain->states[(long) brain->rowstride * cur_state];
+  ruined = 0;
+  nlegal = 0;
+  sumup = 0;
+  for (i = 0; i < n; i++) {
+    weight[i] = row[i] * (float) ((legal >> i) & 1);
+    nlegal += (legal >> i) & 1;
+    sumup += weight[i];
+  }
+  BZ_TRACE (" total tokens: %f ", sumup);
+  if (sumup <= 1) {    ///   ARBITRARY CHOICE, same as bz__pick
+    if (underflows) { (*underflows)++;}
+    BZ__COUNT (brain, underflows, 1);
+    ruined = 1;
+    bz__invalidate (brain, cur_state);
+    for (b = legal; b; b &= b - 1) {
+      i = __builtin_ctzll (b);
+      row[i] = weight[i] = brain->starting_tokens;
+    }
+    sumup = n * brain->starting_tokens;
+  }
+  if (evse) {
+    bz__expo_init (&ex, *evse);
+    inv_avg = nlegal / sumup;
+    sumup2 = 0;
+    if (ex.kind) {
+      //   just multiplies - cheaper to do them all than to branch
+      for (i = 0; i < n; i++) {
+	float w = bz__expo_pow (&ex, weight[i] * inv_avg);
+	weight[i] = ((legal >> i) & 1) ? w : 0;
+	sumup2 += weight[i];
+      }
+    } else {
+      for (b = legal; b; b &= b - 1) {
+	i = __builtin_ctzll (b);
+	weight[i] = bz__expo_pow (&ex, weight[i] * inv_avg);
+	sumup2 += weight[i];
       }
     }
+    myrandom = bz__rng_random (rng, ruined ? n : sumup2);
+  } else {
+    myrandom = bz__rng_random (rng, sumup);
+  }
+  for (b = legal; b; b &= b - 1) {
+    i = __builtin_ctzll (b);
+    myrandom -= weight[i];
+    if (myrandom <= 0) return (i);
   }
   return 0;
 }
 
+//       Which action counts get their own kernels.   The default covers
+//       ball-and-track (3), tic-tac-toe (9) and a few other likely
+//       shapes; build with e.g. -DBZ_KERNEL_ACTIONS='BZ__K(3) BZ__K(5)'
+//       to pick your own (each must be 1 to 63).
+#ifndef BZ_KERNEL_ACTIONS
+#define BZ_KERNEL_ACTIONS BZ__K(2) BZ__K(3) BZ__K(4) BZ__K(8) BZ__K(9) \
+  BZ__K(16)
+#endif
+
+static int bz__kernelfor (bz_brain *brain) {
+  if (brain->states == NULL || brain->hash || brain->qstates
+      || brain->factors)
+    return (0);
+  switch (brain->maxactions) {
+#define BZ__K(n) case n: return (n);
+    BZ_KERNEL_ACTIONS
+#undef BZ__K
+  }
+  return (0);
+}
+
+static long bz__pickn (bz_brain *brain, bz_rng *rng, long cur_state,
+		       float *evse, bz_maskword legal, int *underflows) {
+  switch (brain->maxactions) {
+#define BZ__K(n)							\
+    case n: {								\
+      _Static_assert ((n) >= 1 && (n) <= 63,				\
+		      "BZ_KERNEL_ACTIONS must be 1 to 63");		\
+      return (bz__pickfixed (brain, rng, cur_state, evse, legal,	\
+			     underflows, n));				\
+    }
+    BZ_KERNEL_ACTIONS
+#undef BZ__K
+  }
+  return (0);
+}
+
+//       Inference mode - see bzerker.h.
+
+int bz_inferencemode (bz_brain *brain, float *evse) {
+  struct bz__infer *inf;
+  long words;
+  BZ_TRACE ("inferencemode called\n");
+  //   the tables are per dense state
+  if (brain->hash || brain->factors) return (1);
+  inf = brain->infer;
+  if (inf == NULL) {
+    words = BZ_MASKWORDS (brain->maxactions);
+    inf = malloc (sizeof (struct bz__infer));
+    if (inf == NULL) return (1);
+    inf->cdf = malloc (sizeof (float) * brain->maxstates * brain->maxactions);
+    inf->masks = malloc (sizeof (bz_maskword) * brain->maxstates * words);
+    inf->valid = malloc (brain->maxstates);
+    if (inf->cdf == NULL || inf->masks == NULL || inf->valid == NULL) {
+      free (inf->cdf);
+      free (inf->masks);
+      free (inf->valid);
+      free (inf);
+      return (1);
+    }
+  }
+  inf->evse = (evse == NULL) ? 1.0 : *evse;
+  memset (inf->valid, 0, brain->maxstates);   //  new evse, new tables
+  brain->infer = inf;
+  return (0);
+}
+
+//       (Re)build one state's cumulative table for the given mask.
+static void bz__buildcdf (bz_brain *brain, long state,
+			  const bz_maskword *legalbits) {
+  struct bz__infer *inf;
+  int legal[brain->maxactions];
+  int nlegal, i, j;
+  float *row, *cdf, sumup, inv_avg, run;
+  float rowbuf[brain->maxactions];
+  bz__expo ex;
+  bz_maskword *mymask;
+  inf = brain->infer;
+  row = bz__row (brain, state, rowbuf);
+  cdf = &inf->cdf[brain->maxactions * state];
+  mymask = &inf->masks[(long) BZ_MASKWORDS (brain->maxactions) * state];
+  memcpy (mymask, legalbits,
+	  sizeof (bz_maskword) * BZ_MASKWORDS (brain->maxactions));
+  nlegal = bz__legalfrombits (brain, legalbits, legal);
+  sumup = 0;
+  for (i = 0; i < nlegal; i++) sumup += row[legal[i]];
+  bz__expo_init (&ex, inf->evse);
+  inv_avg = (sumup > 1) ? nlegal / sumup : 0;
+  run = 0;
+  j = 0;
+  for (i = 0; i < brain->maxactions; i++) {
+    if (j < nlegal && legal[j] == i) {
+      //   a dry box gets an even spread, same as a refill would give it
+      run += (sumup > 1) ? bz__expo_pow (&ex, row[i] * inv_avg) : 1.0f;
+      j++;
+    }
+    cdf[i] = run;   //  illegal actions add nothing, so never get picked
+  }
+  inf->valid[state] = 1;
+}
+
+long bz_nextaction_cached (
+			    bz_brain *brain,
+			    bz_rng *rng,
+			    long cur_state,
+			    const bz_maskword *legalbits
+			    )
+{
+  struct bz__infer *inf;
+  float *cdf, r;
+  int lo, hi, mid, words, w;
+  inf = brain->infer;
+  if (inf == NULL) {
+    //   nobody turned on inference mode; just do it the long way
+    return (bz_nextaction_bits (brain, rng, cur_state, NULL, legalbits, NULL));
+  }
+  BZ__COUNT (brain, decisions, 1);
+  if (rng == NULL) rng = &brain->rng;
+  words = BZ_MASKWORDS (brain->maxactions);
+  //   tidy copy of the mask (no stray bits past maxactions) to compare
+  bz_maskword mask[words];
+  if (legalbits) {
+    for (w = 0; w < words; w++) mask[w] = legalbits[w];
+    if (brain->maxactions & 63)
+      mask[words - 1] &= (((bz_maskword) 1) << (brain->maxactions & 63)) - 1;
+  } else {
+    bz_maskbits (brain, NULL, mask);
+  }
+  bz__lockrow (brain, cur_state);
+  if ( ! inf->valid[cur_state]
+       || memcmp (mask, &inf->masks[(long) words * cur_state],
+		  sizeof (bz_maskword) * words))
+    bz__buildcdf (brain, cur_state, mask);
+  cdf = &inf->cdf[brain->maxactions * cur_state];
+  //   first action whose running sum is past r
+  r = bz__rng_random (rng, cdf[brain->maxactions - 1]);
+  lo = 0;
+  hi = brain->maxactions - 1;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (cdf[mid] > r) hi = mid;
+    else lo = mid + 1;
+  }
+  //   r can round up to the whole total, and then nothing is past it and
+  //   we've landed on the last action, legal or not - back up to the
+  //   last one that actually added something
+  while (lo > 0 && cdf[lo] == cdf[lo - 1]) lo--;
+  bz__unlockrow (brain, cur_state);
+  return (lo);
+}
+
+//       Pack a char mask (>=0 is allowed, as in bz_nextaction) into bits.
+void bz_maskbits (bz_brain *brain, char *mask, bz_maskword *bits) {
+  int i;
+  memset (bits, 0, sizeof (bz_maskword) * BZ_MASKWORDS (brain->maxactions));
+  for (i = 0; i < brain->maxactions; i++)
+    if (mask == NULL || mask[i] >= 0)
+      bits[i / 64] |= ((bz_maskword) 1) << (i % 64);
+}
+
+//       Greedy policies - see bzerker.h.
+
+bz_policy *bz_newpolicy (bz_brain *brain, bz_legal_fn legal, void *userdata) {
+  bz_policy *p;
+  bz_maskword bits[BZ_MASKWORDS (brain->maxactions)];
+  float rowbuf[brain->maxactions], *row, best;
+  long s;
+  int a, pick;
+  BZ_TRACE ("newpolicy called\n");
+  if (brain->hash) {
+    fprintf (stderr, "BZERKER - hashed brains have no state table to export\n");
+    return (NULL);
+  }
+  if (brain->maxactions > 255) {
+    fprintf (stderr, "BZERKER - a policy holds at most 255 actions, not %d\n",
+	     brain->maxactions);
+    return (NULL);
+  }
+  p = malloc (sizeof (bz_policy));
+  if (p == NULL) return (NULL);
+  p->nstates = brain->maxstates;
+  p->nactions = brain->maxactions;
+  //   the biggest entry means "nothing legal", so 15 actions fit a nibble
+  p->bits = (brain->maxactions < 16) ? 4 : 8;
+  p->none = (1 << p->bits) - 1;
+  p->bytes = (p->bits == 4) ? (p->nstates + 1) / 2 : p->nstates;
+  p->table = calloc (p->bytes, 1);
+  if (p->table == NULL) {
+    fprintf (stderr, "BZERKER - no memory for a %ld state policy\n",
+	     p->nstates);
+    free (p);
+    return (NULL);
+  }
+  for (s = 0; s < p->nstates; s++) {
+    pick = -1;
+    if (legal) {
+      memset (bits, 0, sizeof (bits));
+      if (legal (userdata, s, bits) == 0) pick = p->none;
+    } else {
+      bz_maskbits (brain, NULL, bits);
+    }
+    if (pick < 0) {
+      best = 0;
+      bz__lockrow (brain, s);
+      row = bz__row (brain, s, rowbuf);
+      for (a = 0; a < brain->maxactions; a++)
+	if ((bits[a / 64] >> (a % 64)) & 1
+	    && (pick < 0 || row[a] > best)) {
+	  pick = a;
+	  best = row[a];
+	}
+      bz__unlockrow (brain, s);
+      if (pick < 0) pick = p->none;
+    }
+    if (p->bits == 4) p->table[s >> 1] |= pick << ((s & 1) << 2);
+    else p->table[s] = pick;
+  }
+  return (p);
+}
+
+long bz_policyaction (const bz_policy *policy, long state) {
+  int v;
+  if (state < 0 || state >= policy->nstates) return (-1);
+  if (policy->bits == 4)
+    v = (policy->table[state >> 1] >> ((state & 1) << 2)) & 15;
+  else
+    v = policy->table[state];
+  return (v == policy->none ? -1 : v);
+}
+
+void bz_killpolicy (bz_policy *policy) {
+  if (policy == NULL) return;
+  free (policy->table);
+  free (policy);
+}
+
 //    Chains are a way to do learnable recordings; a block
 //    is a fixed-size array but a chain is a linked list.  You're trading
 //    off malloc/free time versus time to scan an entire struct the size of
 //    the "brain".
 
+//    Links are carved out of slabs; each slab is one malloc holding a run
+//    of links with each link's mask bytes right behind it.   Links that
+//    are truncated or cleared go on the chain's free list and get reused,
+//    so a chain that is zeroed and refilled stops touching malloc at all
+//    once it has reached its longest length.
+typedef struct bz__slab {
+  struct bz__slab *next;
+} bz__slab;
+
+#define BZ__FIRSTSLAB 16
+
+static size_t bz__chelsize (bz_brain *brain) {
+  size_t sz;
+  //  keep every link pointer-aligned, mask bytes and all
+  sz = sizeof (bz__chel) + brain->maxactions;
+  return ((sz + sizeof (void *) - 1) & ~(sizeof (void *) - 1));
+}
+
+static int bz__growchain (bz_chain *chain) {
+  bz__slab *slab;
+  bz__chel *mychel;
+  char *cursor;
+  size_t chelsize;
+  long i;
+  chelsize = bz__chelsize (chain->brain);
+  slab = malloc (sizeof (bz__slab) + chelsize * chain->slabsize);
+  if (slab == NULL) return (1);
+  slab->next = chain->slabs;
+  chain->slabs = slab;
+  cursor = (char *) (slab + 1);
+  for (i = 0; i < chain->slabsize; i++) {
+    mychel = (bz__chel *) cursor;
+    mychel->maskbuf = cursor + sizeof (bz__chel);
+    mychel->next = chain->freechels;
+    chain->freechels = mychel;
+    cursor += chelsize;
+  }
+  chain->slabsize *= 2;
+  return (0);
+}
+
 bz_chain *bz_newchain (bz_brain *brain){
   bz_chain *mychain;
   mychain = malloc (sizeof (bz_chain));
   mychain->totalcount = 0;
   mychain->chels = NULL;
+  mychain->tail = NULL;
+  mychain->freechels = NULL;
+  mychain->slabs = NULL;
+  mychain->slabsize = BZ__FIRSTSLAB;
   mychain->brain = brain;
+  mychain->ring = NULL;
+  mychain->ringsize = 0;
+  mychain->ringhead = 0;
+  return mychain;
+}
+
+//   A ring chain is one slab of "capacity" links used round-robin.  The
+//   live links are always the slots ringhead, ringhead-1, ... going
+//   back totalcount of them, linked newest to oldest exactly like an
+//   ordinary chain, so everything that walks chain->chels just works.
+bz_chain *bz_newringchain (bz_brain *brain, long capacity) {
+  bz_chain *mychain;
+  bz__slab *slab;
+  bz__chel *mychel;
+  size_t chelsize;
+  long i;
+  if (capacity < 1) {
+    fprintf (stderr, "BZERKER - a ring chain needs room for at least one link\n");
+    return (NULL);
+  }
+  mychain = bz_newchain (brain);
+  if (mychain == NULL) return (NULL);
+  chelsize = bz__chelsize (brain);
+  slab = malloc (sizeof (bz__slab) + chelsize * capacity);
+  if (slab == NULL) {
+    free (mychain);
+    return (NULL);
+  }
+  slab->next = NULL;
+  mychain->slabs = slab;
+  mychain->ring = (char *) (slab + 1);
+  for (i = 0; i < capacity; i++) {
+    mychel = (bz__chel *) (mychain->ring + i * chelsize);
+    mychel->maskbuf = (char *) mychel + sizeof (bz__chel);
+    mychel->next = NULL;
+  }
+  mychain->ringsize = capacity;
+  //   so the first link lands in slot 0
+  mychain->ringhead = capacity - 1;
   return mychain;
 }
 
+//   Next ring slot for a new link; if the ring is full that's the oldest
+//   link, so drop it first (the one after it becomes the oldest).
+static bz__chel *bz__ringslot (bz_chain *chain) {
+  size_t chelsize;
+  bz__chel *oldest;
+  chelsize = bz__chelsize (chain->brain);
+  chain->ringhead = (chain->ringhead + 1) % chain->ringsize;
+  if (chain->totalcount == chain->ringsize) {
+    chain->totalcount --;
+    if (chain->totalcount == 0) {
+      chain->chels = NULL;
+      chain->tail = NULL;
+    } else {
+      oldest = (bz__chel *) (chain->ring + ((chain->ringhead + 1)
+					     % chain->ringsize) * chelsize);
+      oldest->next = NULL;
+      chain->tail = oldest;
+    }
+  }
+  return ((bz__chel *) (chain->ring + chain->ringhead * chelsize));
+}
+
+//   Same, but with a packed legal-action bitmask.   Stored as a char
+//   mask (1 / -1) so the chain learns exactly as if you'd passed that.
+void bz_addtochain_bits (bz_chain *chain, long state, long action,
+			 const bz_maskword *legalbits) {
+  int i;
+  char mask[chain->brain->maxactions];
+  if (legalbits == NULL) {
+    bz_addtochain (chain, state, action, NULL);
+    return;
+  }
+  for (i = 0; i < chain->brain->maxactions; i++)
+    mask[i] = ((legalbits[i / 64] >> (i % 64)) & 1) ? 1 : -1;
+  bz_addtochain (chain, state, action, mask);
+}
+
 //   Add an action to the front of the chain for later learning
 void bz_addtochain (bz_chain *chain, long state, long action, char *mask) {
   bz__chel *mychel;
-  if (state >= chain->brain->maxstates)
+  if (state >= chain->brain->maxstates && chain->brain->hash == NULL
+      && chain->brain->factors == NULL)
     fprintf (stderr,
 	     "State value too high for this brain!  Got %d, range for this brain is 0 to %d \n", state, chain->brain->maxstates-1 );
   if (action >= chain->brain->maxactions)
     fprintf (stderr,
 	     "Action value too high for this brain!  Got %d, max for this brain is 0 to %d \n", action, chain->brain->maxactions-1 );
-  mychel = malloc (sizeof (bz__chel));
+  if (chain->ringsize) {
+    mychel = bz__ringslot (chain);
+  } else {
+    if (chain->freechels == NULL && bz__growchain (chain)) {
+      fprintf (stderr, "BZERKER - out of memory growing a chain\n");
+      return;
+    }
+    mychel = chain->freechels;
+    chain->freechels = mychel->next;
+  }
   mychel->state = state;
   mychel->action = action;
   mychel->next = chain->chels;
   mychel->mask = NULL;
   if (mask) {
-    mychel->mask = malloc (chain->brain->maxactions);
-    memcpy (mychel->mask, mask, chain->brain->maxactions);
+    memcpy (mychel->maskbuf, mask, chain->brain->maxactions);
+    mychel->mask = mychel->maskbuf;
   }
+  if (chain->chels == NULL) chain->tail = mychel;
   chain->chels = mychel;
   chain->totalcount ++;
   return;
@@ -452,51 +1848,138 @@ int bz_truncatechain (bz_chain *chain, long count) {
     mychel = mychel->next;
   }
   //  mychel is now pointing to the last good element.  Cut the
-  //  chain but hold onto the free end of to-be-deleted elements!
+  //  chain and hand the whole cut-off end to the free list in one go
+  //  (a ring just forgets them; their slots come round again anyway).
   nextchel = mychel->next;
+  if (nextchel == NULL) return (0);
   mychel->next = NULL;
-  //  now mychel is first chel to be deleted.
-  mychel = nextchel;   
-  while (mychel) {
-    nextchel = mychel -> next;
-    if (mychel->mask) free (mychel->mask);
-    free (mychel);
-    idropped++;
-    mychel = nextchel;
+  idropped = chain->totalcount - (count + 1);
+  if (chain->ringsize == 0) {
+    chain->tail->next = chain->freechels;
+    chain->freechels = nextchel;
   }
+  chain->tail = mychel;
+  chain->totalcount = count + 1;
   return (idropped);
 }
 
-int bz_learnstateaction (bz_brain *brain, int state, int action, char *mask,
-		    float add, float multiply, int *on_empty) {
-  brain->states[brain->maxactions * state + action] =
-    add +
-    multiply * brain->states[brain->maxactions * state + action];
-  //  zero check - no negativity allowed, nor zero sum states!
-  if (brain->states[brain->maxactions * state + action] <= TOKENMIN ) {
-    brain->states[brain->maxactions * state + action] = TOKENMIN;
-    //   questionable if we need this any more, as long as TOKENMIN is > 0
-    int iac;
+//    The learning core, specialized for a fixed action count like
+//    bz__pickfixed (and only for the brains that have a kernel): no
+//    scratch row, and the dry-box sweep unrolls.   Same arithmetic, in
+//    the same order, as the general version below.
+static inline __attribute__ ((always_inline)) void bz__learnfixed (
+		       bz_brain *brain, long state, int action, char *mask,
+		       const bz_maskword *bits, float add, float multiply,
+		       const int n) {
+  float *row, tokensum;
+  int iac;
+  row = &brain->states[(long) brain->rowstride * state];
+  bz__invalidate (brain, state);
+  row[action] = add + multiply * row[action];
+  if (row[action] <= TOKENMIN ) {
+    row[action] = TOKENMIN;
+    BZ__COUNT (brain, clamps, 1);
+    tokensum = 0;
+    for (iac = 0; iac < n; iac++) {
+      if (mask) {
+	if (mask[iac] >= 0) tokensum += row[iac];
+      } else if (bits) {
+	if ((bits[0] >> iac) & 1) tokensum += row[iac];
+      } else {
+	tokensum += row[iac];
+      }
+    }
+    if (tokensum <= TOKENMIN * n * n)
+      for (iac = 0; iac < n; iac++) row[iac] = brain->starting_tokens;
+  }
+}
+
+//    The learning core.   At most one of mask / bits is non-NULL; they
+//    only matter when a box runs dry and we check the rest of its row.
+static void bz__learn (bz_brain *brain, long state, int action, char *mask,
+		       const bz_maskword *bits, float add, float multiply) {
+  float *row;
+  BZ__COUNT (brain, learns, 1);
+  if (bz__kernelfor (brain)) {
+    switch (brain->maxactions) {
+#define BZ__K(n)							\
+      case n:								\
+	bz__learnfixed (brain, state, action, mask, bits, add, multiply, n); \
+	return;
+      BZ_KERNEL_ACTIONS
+#undef BZ__K
+    }
+  }
+  if (brain->factors) {
+    //   every factor learns its own digit of the state
+    struct bz__factors *f;
+    long s;
+    int i;
+    f = brain->factors;
+    for (i = 0; i < f->count; i++) {
+      s = state % f->sizes[i];
+      state /= f->sizes[i];
+      bz__lockrow (f->brains[i], s);
+      bz__learn (f->brains[i], s, action, mask, bits, add, multiply);
+      bz__unlockrow (f->brains[i], s);
+    }
+    return;
+  }
+  float rowbuf[brain->maxactions];
+  row = bz__row (brain, state, rowbuf);
+  bz__invalidate (brain, state);
+  row[action] = add + multiply * row[action];
+  //  zero check - no negativity allowed, nor zero sum states!
+  if (row[action] <= TOKENMIN ) {
+    row[action] = TOKENMIN;
+    BZ__COUNT (brain, clamps, 1);
+    //   questionable if we need this any more, as long as TOKENMIN is > 0
+    int iac;
     float tokensum;
     tokensum = 0;
     for (iac = 0; iac < brain->maxactions; iac++) {
       if (mask) {
-	if (mask[iac] > 0)
-	  	tokensum += brain->states[brain->maxactions * state + iac];
+	if (mask[iac] >= 0)
+	  	tokensum += row[iac];
+      } else if (bits) {
+	if ((bits[iac / 64] >> (iac % 64)) & 1)
+	  tokensum += row[iac];
       } else {
-	tokensum += brain->states[brain->maxactions * state + iac];
+	tokensum += row[iac];
       }
     }
     if (tokensum <= TOKENMIN * brain->maxactions * brain->maxactions) {
       for (iac = 0; iac < brain->maxactions; iac++)
-	brain->states[brain->maxactions *state + iac]=brain->starting_tokens;
+	row[iac]=brain->starting_tokens;
     }
   }
+  bz__rowdone (brain, state, row);
+}
+
+int bz_learnstateaction (bz_brain *brain, long state, int action, char *mask,
+		    float add, float multiply, int *on_empty) {
+  bz__lockrow (brain, state);
+  bz__learn (brain, state, action, mask, NULL, add, multiply);
+  bz__unlockrow (brain, state);
+  return (0);
+}
+
+int bz_learnstateaction_bits (bz_brain *brain, long state, int action,
+			      const bz_maskword *legalbits,
+			      float add, float multiply, int *on_empty) {
+  bz__lockrow (brain, state);
+  bz__learn (brain, state, action, NULL, legalbits, add, multiply);
+  bz__unlockrow (brain, state);
+  return (0);
 }
 
 void bz_learnchain (bz_brain *brain, bz_chain *chain,
 		   float add, float multiply, int *on_empty) {
   bz__chel *thischel;
+  BZ__COUNT (brain, chains, 1);
+  BZ__COUNT (brain, chainlinks, chain->totalcount);
+  //   (racy if shared, but a high-water mark can stand to be a bit off)
+  BZ__MAXCHAIN (brain, chain->totalcount);
   thischel = chain->chels;
   while (thischel) {
     bz_learnstateaction (brain, thischel->state, thischel->action,
@@ -505,22 +1988,2203 @@ void bz_learnchain (bz_brain *brain, bz_chain *chain,
   }
 }
 
+//    Empty a chain so it can be reused for the next episode.   Nothing
+//    is freed - all the links go back on the free list in one splice.
+void bz_zerochain (bz_chain *chain) {
+  if (chain->chels && chain->ringsize == 0) {
+    chain->tail->next = chain->freechels;
+    chain->freechels = chain->chels;
+  }
+  chain->chels = NULL;
+  chain->tail = NULL;
+  chain->totalcount = 0;
+}
+
 void bz_killchain (bz_chain *chain) {
-  bz__chel *mychel, *nextchel;
-  mychel = chain->chels;
-  while (mychel) {
-    nextchel = mychel -> next;
-    if (mychel->mask) free (mychel->mask);
-    free (mychel);
-    mychel = nextchel;
+  bz__slab *myslab, *nextslab;
+  myslab = chain->slabs;
+  while (myslab) {
+    nextslab = myslab->next;
+    free (myslab);
+    myslab = nextslab;
   }
   free (chain);
 }
 
+//    Blocks are the other kind of learnable recording: a use-count for
+//    every cell of the brain.   Everything is allocated up front, so
+//    adding is just a couple of array writes; the dirty list tells us
+//    which cells to learn and clear, so we never scan the whole brain.
+
+bz_block *bz_newblock (bz_brain *brain) {
+  bz_block *myblock;
+  long cells;
+  BZ_TRACE ("newblock called\n");
+  if (brain->hash || brain->factors) {
+    fprintf (stderr, "BZERKER - blocks need a dense brain; use a chain.\n");
+    return (NULL);
+  }
+  cells = (long) brain->maxstates * brain->maxactions;
+  myblock = malloc (sizeof (bz_block));
+  if (myblock == NULL) return (NULL);
+  myblock->brain = brain;
+  myblock->counts = calloc (cells, sizeof (int));
+  myblock->masks = malloc (cells);
+  myblock->hasmask = calloc (brain->maxstates, 1);
+  myblock->dirtysize = 1024;
+  myblock->dirty = malloc (sizeof (long) * myblock->dirtysize);
+  myblock->ndirty = 0;
+  myblock->totalcount = 0;
+  if (myblock->counts == NULL || myblock->masks == NULL
+      || myblock->hasmask == NULL || myblock->dirty == NULL) {
+    bz_killblock (myblock);
+    return (NULL);
+  }
+  return (myblock);
+}
+
+//   Mark a state/action as used.   If the same pair is used twice, it
+//   gets learned twice, just like two links in a chain would - but with
+//   the state's last mask both times, as there's only room for one.
+void bz_addtoblock (bz_block *block, long state, long action, char *mask) {
+  long cell;
+  if (state >= block->brain->maxstates || state < 0) {
+    fprintf (stderr,
+	     "State value out of range for this brain!  Got %ld, range for this brain is 0 to %d \n", state, block->brain->maxstates-1 );
+    return;
+  }
+  if (action >= block->brain->maxactions || action < 0) {
+    fprintf (stderr,
+	     "Action value out of range for this brain!  Got %ld, range for this brain is 0 to %d \n", action, block->brain->maxactions-1 );
+    return;
+  }
+  cell = state * block->brain->maxactions + action;
+  if (block->counts[cell]++ == 0) {
+    //   first touch of this cell since the last clear - remember it
+    if (block->ndirty >= block->dirtysize) {
+      long *bigger;
+      bigger = realloc (block->dirty, sizeof (long) * block->dirtysize * 2);
+      if (bigger == NULL) {
+	fprintf (stderr, "BZERKER - out of memory growing a block\n");
+	block->counts[cell]--;
+	return;
+      }
+      block->dirty = bigger;
+      block->dirtysize *= 2;
+    }
+    block->dirty[block->ndirty++] = cell;
+  }
+  if (mask) {
+    memcpy (&block->masks[state * block->brain->maxactions], mask,
+	    block->brain->maxactions);
+    block->hasmask[state] = 1;
+  }
+  block->totalcount++;
+}
+
+//   Learn every used cell, once per use.   We go newest-first, the same
+//   order a chain would give us.
+void bz_learnblock (bz_brain *brain, bz_block *block,
+		    float add, float multiply, int *on_empty) {
+  long i, cell, state, action;
+  int n;
+  for (i = block->ndirty - 1; i >= 0; i--) {
+    cell = block->dirty[i];
+    state = cell / brain->maxactions;
+    action = cell % brain->maxactions;
+    for (n = 0; n < block->counts[cell]; n++)
+      bz_learnstateaction (brain, state, action,
+			   block->hasmask[state]
+			   ? &block->masks[state * brain->maxactions] : NULL,
+			   add, multiply, on_empty);
+  }
+}
+
+//   Clear only what we dirtied.
+void bz_zeroblock (bz_block *block) {
+  long i, cell;
+  for (i = 0; i < block->ndirty; i++) {
+    cell = block->dirty[i];
+    block->counts[cell] = 0;
+    block->hasmask[cell / block->brain->maxactions] = 0;
+  }
+  block->ndirty = 0;
+  block->totalcount = 0;
+}
+
+void bz_killblock (bz_block *block) {
+  if (block == NULL) return;
+  free (block->counts);
+  free (block->masks);
+  free (block->hasmask);
+  free (block->dirty);
+  free (block);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+//      Symmetry canonicalization
+//
+////////////////////////////////////////////////////////////////////////
+//
+//    Everything is worked out once, up front, into flat tables, so the
+//    per-move cost is two lookups and a permutation of the mask.
+
+bz_canon *bz_newcanon (long nstates, int nactions, int nsyms,
+		       const int *perms, bz_symmetry_fn apply,
+		       void *userdata) {
+  bz_canon *canon;
+  long state, image, best, *number;
+  int s, a, bestsym;
+  BZ_TRACE ("newcanon called\n");
+  if (nsyms < 1 || nsyms > 256) {
+    fprintf (stderr, "BZERKER - canon needs 1 to 256 symmetries.\n");
+    return (NULL);
+  }
+  canon = malloc (sizeof (bz_canon));
+  number = malloc (sizeof (long) * nstates);
+  if (canon == NULL || number == NULL) {
+    free (canon);
+    free (number);
+    return (NULL);
+  }
+  canon->nstates = nstates;
+  canon->nactions = nactions;
+  canon->nsyms = nsyms;
+  canon->canon = malloc (sizeof (long) * nstates);
+  canon->sym = malloc (nstates);
+  canon->perm = malloc (sizeof (int) * nsyms * nactions);
+  canon->inv = malloc (sizeof (int) * nsyms * nactions);
+  if (!canon->canon || !canon->sym || !canon->perm || !canon->inv) {
+    free (number);
+    bz_killcanon (canon);
+    return (NULL);
+  }
+  memcpy (canon->perm, perms, sizeof (int) * nsyms * nactions);
+  for (s = 0; s < nsyms; s++)
+    for (a = 0; a < nactions; a++)
+      canon->inv[s * nactions + perms[s * nactions + a]] = a;
+  //   The representative is never bigger than the state itself, so by
+  //   the time we get to a state its representative has its number.
+  canon->ncanon = 0;
+  for (state = 0; state < nstates; state++) {
+    best = state;
+    bestsym = 0;
+    for (s = 1; s < nsyms; s++) {
+      image = apply (userdata, state, s);
+      if (image < best) {
+	best = image;
+	bestsym = s;
+      }
+    }
+    if (best == state) number[state] = canon->ncanon++;
+    canon->canon[state] = number[best];
+    canon->sym[state] = bestsym;
+  }
+  free (number);
+  return (canon);
+}
+
+void bz_killcanon (bz_canon *canon) {
+  if (canon == NULL) return;
+  free (canon->canon);
+  free (canon->sym);
+  free (canon->perm);
+  free (canon->inv);
+  free (canon);
+}
+
+long bz_canonstate (bz_canon *canon, long state, int *sym) {
+  if (state < 0 || state >= canon->nstates) {
+    fprintf (stderr,
+	     "BZERKER - state %ld out of range for this canon (0 to %ld)\n",
+	     state, canon->nstates - 1);
+    if (sym) *sym = 0;
+    return (-1);
+  }
+  if (sym) *sym = canon->sym[state];
+  return (canon->canon[state]);
+}
+
+void bz_canonmask (bz_canon *canon, int sym, const bz_maskword *rawbits,
+		   bz_maskword *canonbits) {
+  const int *perm;
+  int a, to;
+  perm = &canon->perm[sym * canon->nactions];
+  memset (canonbits, 0, sizeof (bz_maskword) * BZ_MASKWORDS (canon->nactions));
+  for (a = 0; a < canon->nactions; a++)
+    if ((rawbits[a / 64] >> (a % 64)) & 1) {
+      to = perm[a];
+      canonbits[to / 64] |= ((bz_maskword) 1) << (to % 64);
+    }
+}
+
+long bz_nextaction_canon (bz_brain *brain, bz_canon *canon, bz_rng *rng,
+			  long state, float *evse,
+			  const bz_maskword *legalbits, int *underflows) {
+  bz_maskword bits[BZ_MASKWORDS (canon->nactions)];
+  long action;
+  int sym;
+  state = bz_canonstate (canon, state, &sym);
+  if (state < 0) return (-1);
+  if (legalbits) bz_canonmask (canon, sym, legalbits, bits);
+  action = bz_nextaction_bits (brain, rng, state, evse,
+			       legalbits ? bits : NULL, underflows);
+  return (canon->inv[sym * canon->nactions + action]);
+}
+
+void bz_addtochain_canon (bz_chain *chain, bz_canon *canon, long state,
+			  long action, const bz_maskword *legalbits) {
+  bz_maskword bits[BZ_MASKWORDS (canon->nactions)];
+  long cstate;
+  int sym;
+  cstate = bz_canonstate (canon, state, &sym);
+  if (cstate < 0) return;
+  if (action < 0 || action >= canon->nactions) {
+    fprintf (stderr,
+	     "BZERKER - action %ld out of range for this canon (0 to %d)\n",
+	     action, canon->nactions - 1);
+    return;
+  }
+  if (legalbits) bz_canonmask (canon, sym, legalbits, bits);
+  bz_addtochain_bits (chain, cstate,
+		      canon->perm[sym * canon->nactions + action],
+		      legalbits ? bits : NULL);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+//      Saving and loading brains
+//
+////////////////////////////////////////////////////////////////////////
+//
+//    The file is a 64-byte header followed by the tokens, in this
+//    machine's own byte order and float format (the header says which,
+//    so a foreign file is refused rather than misread):
+//
+//        dense brains:   maxstates rows of rowstride floats (more than
+//                        maxactions if the brain was made padded)
+//        hashed brains:  capacity uint64 keys (all ones = empty slot),
+//                        then capacity rows of rowstride floats
+//        compact brains: maxstates float row scales, then maxstates
+//                        rows of rowstride uint16 counts
+//
+//    The tokens start at a 64-byte boundary, so bz_mapbrain can point a
+//    brain straight at the mapped file with no copying at all.
+
+static const char bz__magic[8] = { 'B', 'Z', 'B', 'R', 'A', 'I', 'N', 0 };
+
+typedef struct bz__filehead {
+  char magic[8];
+  uint32_t version;        //  BZ_FILE_VERSION
+  uint32_t byteorder;      //  0x01020304 as written by this machine
+  int32_t braintype;
+  int32_t maxstates;
+  int32_t maxactions;
+  int32_t starting_tokens;
+  int32_t rowstride;       //  floats per row on disk
+  int32_t reserved;
+  int64_t rows;            //  dense: maxstates.  hashed: capacity
+  int64_t count;           //  hashed: live rows.  dense: maxstates
+  char pad[8];
+} bz__filehead;
+
+int bz_savebrain (bz_brain *brain, const char *filename) {
+  bz__filehead head;
+  char tmpname[strlen (filename) + 8];
+  FILE *f;
+  long rows, ok;
+  BZ_TRACE ("savebrain called\n");
+  if (brain->factors) {
+    fprintf (stderr, "BZERKER - can't save a factored brain yet.\n");
+    return (1);
+  }
+  memset (&head, 0, sizeof (head));
+  memcpy (head.magic, bz__magic, sizeof (bz__magic));
+  head.version = BZ_FILE_VERSION;
+  head.byteorder = 0x01020304;
+  head.braintype = brain->braintype;
+  head.maxstates = brain->maxstates;
+  head.maxactions = brain->maxactions;
+  head.starting_tokens = brain->starting_tokens;
+  head.rowstride = (brain->states) ? brain->rowstride : brain->maxactions;
+  rows = brain->hash ? brain->hash->capacity : brain->maxstates;
+  head.rows = rows;
+  head.count = bz_brainrows (brain);
+  //   Write a temp file and rename it over the old one, so a crash
+  //   mid-save never leaves a half-written brain behind.
+  sprintf (tmpname, "%s.tmp", filename);
+  f = fopen (tmpname, "wb");
+  if (f == NULL) return (1);
+  ok = fwrite (&head, sizeof (head), 1, f) == 1;
+  if (ok && brain->qstates) {
+    ok = fwrite (brain->scales, sizeof (float), rows, f) == rows
+      && fwrite (brain->qstates, sizeof (uint16_t) * brain->maxactions,
+		 rows, f) == rows;
+  } else if (ok && brain->hash) {
+    ok = fwrite (brain->hash->keys, sizeof (uint64_t), rows, f) == rows
+      && fwrite (brain->hash->rows, sizeof (float) * brain->maxactions,
+		 rows, f) == rows;
+  } else if (ok) {
+    ok = fwrite (brain->states, sizeof (float) * brain->rowstride,
+		 rows, f) == rows;
+  }
+  //   (and make sure it's really on the disk before it replaces anything)
+  if (ok && (fflush (f) != 0 || fsync (fileno (f)) != 0)) ok = 0;
+  if (fclose (f) != 0) ok = 0;
+  if ( ! ok || rename (tmpname, filename) != 0) {
+    unlink (tmpname);
+    return (1);
+  }
+  return (0);
+}
+
+//    Check a header (and the file length) before we believe any of it.
+//    The fields have to agree with each other too: a dense or compact
+//    brain's rows are its states (bz__row indexes by state), and a hash
+//    table needs a power-of-two capacity with at least one empty slot,
+//    or a lookup that misses would probe forever.   (That's only the
+//    header's word for it; bz__checkkeys counts the keys themselves.)
+static int bz__checkhead (bz__filehead *head, long filelen) {
+  long perrow;
+  if (memcmp (head->magic, bz__magic, sizeof (bz__magic)) != 0
+      || head->version != BZ_FILE_VERSION
+      || head->byteorder != 0x01020304
+      || head->maxactions < 1
+      || head->maxstates < 0
+      || head->rowstride < head->maxactions
+      || (head->rowstride != head->maxactions
+	  && head->braintype != BZ_BRAIN_QUANTIZED)   //  only dense rows pad
+      || head->rows < 0)
+    return (1);
+  if (head->braintype == BZ_BRAIN_QUANTIZED)
+    perrow = head->rowstride * sizeof (float);
+  else if (head->braintype == BZ_BRAIN_HASHED)
+    perrow = sizeof (uint64_t) + head->rowstride * sizeof (float);
+  else if (head->braintype == BZ_BRAIN_COMPACT)
+    perrow = sizeof (float) + head->rowstride * sizeof (uint16_t);
+  else
+    return (1);
+  if (head->braintype == BZ_BRAIN_HASHED) {
+    if (head->rows < 1 || (head->rows & (head->rows - 1)) != 0
+	|| head->count < 0 || head->count >= head->rows)
+      return (1);
+  } else if (head->rows != head->maxstates) {
+    return (1);
+  }
+  //   (and the size sum mustn't wrap around and sneak under filelen)
+  if (head->rows > (LONG_MAX - (long) sizeof (bz__filehead)) / perrow)
+    return (1);
+  if (filelen < (long) sizeof (bz__filehead) + head->rows * perrow)
+    return (1);
+  return (0);
+}
+
+//    A hashed brain's keys, once they're in: used slots have to number
+//    what the header said, which still leaves one empty.
+static int bz__checkkeys (const uint64_t *keys, long rows, long count) {
+  long i, used;
+  used = 0;
+  for (i = 0; i < rows; i++)
+    if (keys[i] != BZ__NOKEY) used++;
+  return (used != count || used >= rows);
+}
+
+//    A brain with everything but its tokens.
+static bz_brain *bz__brainshell (bz__filehead *head) {
+  bz_brain *my_brain;
+  my_brain = malloc (sizeof (bz_brain));
+  if (my_brain == NULL) return (NULL);
+  my_brain->braintype = head->braintype;
+  my_brain->maxstates = head->maxstates;
+  my_brain->maxactions = head->maxactions;
+  my_brain->starting_tokens = head->starting_tokens;
+  my_brain->rowstride = head->rowstride;
+  bz_rng_seed (&my_brain->rng, bz__seedbase
+	       + __atomic_fetch_add (&bz__seedcount, 1, __ATOMIC_RELAXED));
+  memset (&my_brain->counters, 0, sizeof (my_brain->counters));
+  my_brain->locks = NULL;
+  my_brain->countslots = NULL;
+  my_brain->infer = NULL;
+  my_brain->factors = NULL;
+  my_brain->trackers = NULL;
+  my_brain->hash = NULL;
+  my_brain->states = NULL;
+  my_brain->mapbase = NULL;
+  my_brain->maplen = 0;
+  my_brain->qstates = NULL;
+  my_brain->scales = NULL;
+  if (head->braintype == BZ_BRAIN_HASHED) {
+    my_brain->hash = malloc (sizeof (struct bz__hash));
+    if (my_brain->hash == NULL) {
+      free (my_brain);
+      return (NULL);
+    }
+    my_brain->hash->capacity = head->rows;
+    my_brain->hash->count = head->count;
+    my_brain->hash->mapped = 0;
+    my_brain->hash->keys = NULL;
+    my_brain->hash->rows = NULL;
+  }
+  return (my_brain);
+}
+
+//    Read a brain into ordinary malloc'd memory.
+bz_brain *bz_loadbrain (const char *filename) {
+  bz__filehead head;
+  bz_brain *brain;
+  FILE *f;
+  struct stat st;
+  long rows, ok;
+  BZ_TRACE ("loadbrain called\n");
+  f = fopen (filename, "rb");
+  if (f == NULL) return (NULL);
+  if (fstat (fileno (f), &st) != 0
+      || fread (&head, sizeof (head), 1, f) != 1
+      || bz__checkhead (&head, st.st_size)
+      || (brain = bz__brainshell (&head)) == NULL) {
+    fclose (f);
+    return (NULL);
+  }
+  rows = head.rows;
+  if (head.braintype == BZ_BRAIN_COMPACT) {
+    brain->scales = malloc (sizeof (float) * rows);
+    brain->qstates = malloc (sizeof (uint16_t) * rows * brain->maxactions);
+    ok = brain->scales && brain->qstates
+      && fread (brain->scales, sizeof (float), rows, f) == rows
+      && fread (brain->qstates, sizeof (uint16_t) * brain->maxactions,
+		rows, f) == rows;
+  } else if (brain->hash) {
+    brain->hash->keys = malloc (sizeof (uint64_t) * rows);
+    brain->hash->rows = malloc (sizeof (float) * rows * brain->maxactions);
+    ok = brain->hash->keys && brain->hash->rows
+      && fread (brain->hash->keys, sizeof (uint64_t), rows, f) == rows
+      && fread (brain->hash->rows, sizeof (float) * brain->maxactions,
+		rows, f) == rows
+      && ! bz__checkkeys (brain->hash->keys, rows, head.count);
+  } else {
+    if (posix_memalign ((void **) &brain->states, 64,
+			sizeof (float) * (rows ? rows : 1) * brain->rowstride))
+      brain->states = NULL;
+    ok = brain->states
+      && fread (brain->states, sizeof (float) * brain->rowstride,
+		rows, f) == rows;
+  }
+  fclose (f);
+  if ( ! ok) {
+    bz_killbrain (brain);
+    return (NULL);
+  }
+  return (brain);
+}
+
+//    Map a brain straight out of the file.   Zero-copy: the tokens ARE
+//    the page cache, shared by every process that maps the same file.
+//    The mapping is private, so if this brain learns, only the pages it
+//    writes get copied (and the file is never changed - save it again
+//    if you want to keep what it learned).
+bz_brain *bz_mapbrain (const char *filename) {
+  bz__filehead *head;
+  bz_brain *brain;
+  struct stat st;
+  void *base;
+  int fd;
+  BZ_TRACE ("mapbrain called\n");
+  fd = open (filename, O_RDONLY);
+  if (fd < 0) return (NULL);
+  if (fstat (fd, &st) != 0 || st.st_size < (long) sizeof (bz__filehead)) {
+    close (fd);
+    return (NULL);
+  }
+  base = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close (fd);   //  the mapping keeps the file alive
+  if (base == MAP_FAILED) return (NULL);
+  head = (bz__filehead *) base;
+  if (bz__checkhead (head, st.st_size)
+      || (brain = bz__brainshell (head)) == NULL) {
+    munmap (base, st.st_size);
+    return (NULL);
+  }
+  brain->mapbase = base;
+  brain->maplen = st.st_size;
+  if (head->braintype == BZ_BRAIN_COMPACT) {
+    brain->scales = (float *) (head + 1);
+    brain->qstates = (uint16_t *) (brain->scales + head->rows);
+  } else if (brain->hash) {
+    brain->hash->keys = (uint64_t *) (head + 1);
+    brain->hash->rows = (float *) (brain->hash->keys + head->rows);
+    brain->hash->mapped = 1;
+    if (bz__checkkeys (brain->hash->keys, head->rows, head->count)) {
+      bz_killbrain (brain);    //  (unmaps too)
+      return (NULL);
+    }
+  } else {
+    brain->states = (float *) (head + 1);
+  }
+  return (brain);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+//      Episode logs - keep experience around for replay
+//
+////////////////////////////////////////////////////////////////////////
+//
+//    An append-only file: a 64-byte header, then records one after the
+//    other, each a bz__logrec followed by its mask words (always
+//    BZ_MASKWORDS(maxactions) of them, all ones if the step had no mask),
+//    so every record is the same size and a reader can walk the file
+//    with plain pointer arithmetic.   A step has action >= 0; an
+//    end-of-episode record has action -1 and carries the reward (add
+//    and multiply) for all the steps since the last one.   Steps are in
+//    the order bz_learnchain would visit them.   Like brain files, it's
+//    this machine's byte order, and the header says so.
+//
+//    A file cut off mid-write (power pull on the rig) loses its last,
+//    unfinished episode: bz_openlog cuts it back to the last whole
+//    episode before appending anything, so nothing new gets glued onto
+//    a torn record or someone else's steps.
+
+static const char bz__logmagic[8] = { 'B', 'Z', 'E', 'P', 'L', 'O', 'G', 0 };
+#define BZ_LOG_VERSION 1
+
+typedef struct bz__loghead {
+  char magic[8];
+  uint32_t version;        //  BZ_LOG_VERSION
+  uint32_t byteorder;      //  0x01020304 as written by this machine
+  int32_t maxactions;
+  int32_t maskwords;
+  char pad[40];
+} bz__loghead;
+
+typedef struct bz__logrec {
+  int64_t state;
+  int32_t action;          //  -1: end of episode
+  int32_t hasmask;
+  float add, multiply;     //  end of episode only
+} bz__logrec;
+
+#define BZ__LOGBUF (256 * 1024)
+
+struct bz__logwriter {
+  int fd;
+  int maxactions;
+  long recsize;            //  bytes per record, mask included
+  long used;
+  char *buf;
+};
+
+struct bz__logreader {
+  char *base;
+  long len;
+  long pos;                //  byte offset of the next record
+  long recsize;
+  int maxactions;
+};
+
+static int bz__logflush (bz_logwriter *log) {
+  long off;
+  ssize_t n;
+  for (off = 0; off < log->used; off += n) {
+    n = write (log->fd, log->buf + off, log->used - off);
+    if (n <= 0) return (1);
+  }
+  log->used = 0;
+  return (0);
+}
+
+//    Where the last whole episode in an existing log ends (just the
+//    header if there isn't one), or -1 if we couldn't read it.
+static long bz__logwholeend (int fd, long len, long recsize) {
+  char *base;
+  long pos, end;
+  end = sizeof (bz__loghead);
+  if (len <= end) return (end);
+  base = mmap (NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED) return (-1);
+  for (pos = end; pos + recsize <= len; pos += recsize)
+    if (((bz__logrec *) (base + pos))->action < 0) end = pos + recsize;
+  munmap (base, len);
+  return (end);
+}
+
+//    Open (or create) a log for appending.   An existing log has to be
+//    for the same number of actions, and anything after its last whole
+//    episode is cut off first; if that can't be done, we won't append.
+bz_logwriter *bz_openlog (const char *filename, int maxactions) {
+  bz_logwriter *log;
+  bz__loghead head;
+  struct stat st;
+  long recsize, end;
+  int fd;
+  BZ_TRACE ("openlog called\n");
+  fd = open (filename, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) return (NULL);
+  if (fstat (fd, &st) != 0) {
+    close (fd);
+    return (NULL);
+  }
+  if (st.st_size == 0) {
+    memset (&head, 0, sizeof (head));
+    memcpy (head.magic, bz__logmagic, sizeof (bz__logmagic));
+    head.version = BZ_LOG_VERSION;
+    head.byteorder = 0x01020304;
+    head.maxactions = maxactions;
+    head.maskwords = BZ_MASKWORDS (maxactions);
+    if (write (fd, &head, sizeof (head)) != sizeof (head)) {
+      close (fd);
+      return (NULL);
+    }
+  } else if (pread (fd, &head, sizeof (head), 0) != sizeof (head)
+	     || memcmp (head.magic, bz__logmagic, sizeof (bz__logmagic))
+	     || head.version != BZ_LOG_VERSION
+	     || head.byteorder != 0x01020304
+	     || head.maxactions != maxactions
+	     || head.maskwords != BZ_MASKWORDS (maxactions)) {
+    close (fd);
+    return (NULL);
+  }
+  recsize = sizeof (bz__logrec)
+    + sizeof (bz_maskword) * BZ_MASKWORDS (maxactions);
+  if (st.st_size > (long) sizeof (head)) {
+    end = bz__logwholeend (fd, st.st_size, recsize);
+    if (end < 0 || (end < st.st_size && ftruncate (fd, end) != 0)) {
+      fprintf (stderr, "BZERKER - couldn't trim %s back to its last whole"
+	       " episode; not appending to it\n", filename);
+      close (fd);
+      return (NULL);
+    }
+  }
+  log = malloc (sizeof (bz_logwriter));
+  if (log == NULL || (log->buf = malloc (BZ__LOGBUF)) == NULL) {
+    free (log);
+    close (fd);
+    return (NULL);
+  }
+  log->fd = fd;
+  log->maxactions = maxactions;
+  log->recsize = recsize;
+  log->used = 0;
+  return (log);
+}
+
+static int bz__logrecord (bz_logwriter *log, long state, int action,
+			  const bz_maskword *bits, float add, float multiply) {
+  bz__logrec *rec;
+  bz_maskword *mask;
+  int w, words;
+  if (log->used + log->recsize > BZ__LOGBUF && bz__logflush (log))
+    return (1);
+  rec = (bz__logrec *) (log->buf + log->used);
+  mask = (bz_maskword *) (rec + 1);
+  words = BZ_MASKWORDS (log->maxactions);
+  rec->state = state;
+  rec->action = action;
+  rec->hasmask = bits != NULL;
+  rec->add = add;
+  rec->multiply = multiply;
+  for (w = 0; w < words; w++) mask[w] = bits ? bits[w] : ~(bz_maskword) 0;
+  log->used += log->recsize;
+  return (0);
+}
+
+//    One step (in the order you'd want them learned), then the episode's
+//    end and reward.   These return nonzero if the disk said no.
+int bz_logstep (bz_logwriter *log, long state, int action,
+		const bz_maskword *legalbits) {
+  return (bz__logrecord (log, state, action, legalbits, 0, 0));
+}
+
+int bz_logend (bz_logwriter *log, float add, float multiply) {
+  return (bz__logrecord (log, 0, -1, NULL, add, multiply));
+}
+
+//    A whole chain as one episode, with the reward you'd give
+//    bz_learnchain.
+int bz_logchain (bz_logwriter *log, bz_chain *chain, float add,
+		 float multiply) {
+  bz_maskword bits[BZ_MASKWORDS (log->maxactions)];
+  bz__chel *thischel;
+  for (thischel = chain->chels; thischel; thischel = thischel->next) {
+    if (thischel->mask) bz_maskbits (chain->brain, thischel->mask, bits);
+    if (bz_logstep (log, thischel->state, thischel->action,
+		    thischel->mask ? bits : NULL))
+      return (1);
+  }
+  return (bz_logend (log, add, multiply));
+}
+
+int bz_closelog (bz_logwriter *log) {
+  int bad;
+  bad = bz__logflush (log);
+  if (close (log->fd) != 0) bad = 1;
+  free (log->buf);
+  free (log);
+  return (bad);
+}
+
+//    Map a log for reading.   The kernel reads ahead since we tell it
+//    we're going front to back, so replay runs at disk speed.
+bz_logreader *bz_openreplay (const char *filename) {
+  bz_logreader *r;
+  bz__loghead *head;
+  struct stat st;
+  void *base;
+  int fd;
+  BZ_TRACE ("openreplay called\n");
+  fd = open (filename, O_RDONLY);
+  if (fd < 0) return (NULL);
+  if (fstat (fd, &st) != 0 || st.st_size < (long) sizeof (bz__loghead)) {
+    close (fd);
+    return (NULL);
+  }
+  base = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (base == MAP_FAILED) return (NULL);
+  head = base;
+  if (memcmp (head->magic, bz__logmagic, sizeof (bz__logmagic))
+      || head->version != BZ_LOG_VERSION
+      || head->byteorder != 0x01020304
+      || head->maxactions < 1
+      || head->maskwords != BZ_MASKWORDS (head->maxactions)
+      || (r = malloc (sizeof (bz_logreader))) == NULL) {
+    munmap (base, st.st_size);
+    return (NULL);
+  }
+  madvise (base, st.st_size, MADV_SEQUENTIAL);
+  r->base = base;
+  r->len = st.st_size;
+  r->pos = sizeof (bz__loghead);
+  r->maxactions = head->maxactions;
+  r->recsize = sizeof (bz__logrec) + sizeof (bz_maskword) * head->maskwords;
+  return (r);
+}
+
+//    Find the next complete episode: its first record, how many steps,
+//    and the end record.   0 when there are no more.
+static int bz__nextepisode (bz_logreader *r, bz__logrec **first, long *steps,
+			    bz__logrec **end) {
+  bz__logrec *rec;
+  long pos;
+  *first = (bz__logrec *) (r->base + r->pos);
+  *steps = 0;
+  for (pos = r->pos; pos + r->recsize <= r->len; pos += r->recsize) {
+    rec = (bz__logrec *) (r->base + pos);
+    if (rec->action < 0) {
+      *end = rec;
+      r->pos = pos + r->recsize;
+      return (1);
+    }
+    (*steps)++;
+  }
+  return (0);
+}
+
+#define BZ__LOGMASK(rec) ((rec)->hasmask ? (bz_maskword *) ((rec) + 1) : NULL)
+
+//    Does every step of an episode fit this brain?   (A log from a
+//    bigger brain, or a corrupt one, mustn't write past its rows.)
+static int bz__logepisodefits (bz_logreader *r, bz_brain *brain,
+			       bz__logrec *first, long steps) {
+  bz__logrec *rec;
+  long i;
+  for (i = 0; i < steps; i++) {
+    rec = (bz__logrec *) ((char *) first + i * r->recsize);
+    if (rec->action < 0 || rec->action >= brain->maxactions
+	|| rec->state < 0
+	|| ( ! brain->hash && rec->state >= brain->maxstates))
+      return (0);
+  }
+  return (1);
+}
+
+//    Read the next episode into a chain (zeroed first), ready for
+//    bz_learnchain with the add and multiply it came with.   Episodes
+//    with a state or action that doesn't fit the chain's brain are
+//    skipped.   Returns 0 when the log runs out.
+int bz_replayepisode (bz_logreader *r, bz_chain *chain,
+		      float *add, float *multiply) {
+  bz__logrec *first, *end, *rec;
+  long steps, i;
+  do {
+    if ( ! bz__nextepisode (r, &first, &steps, &end)) return (0);
+    if (bz__logepisodefits (r, chain->brain, first, steps)) break;
+    fprintf (stderr, "BZERKER - skipping a logged episode that doesn't"
+	     " fit the brain\n");
+  } while (1);
+  bz_zerochain (chain);
+  //   chains grow at the front, so add oldest-learned last
+  for (i = steps - 1; i >= 0; i--) {
+    rec = (bz__logrec *) ((char *) first + i * r->recsize);
+    bz_addtochain_bits (chain, rec->state, rec->action, BZ__LOGMASK (rec));
+  }
+  *add = end->add;
+  *multiply = end->multiply;
+  return (1);
+}
+
+void bz_closereplay (bz_logreader *r) {
+  munmap (r->base, r->len);
+  free (r);
+}
+
+//    Teach a brain everything in a log, exactly as if each episode had
+//    been bz_learnchain'd as it happened, but with no chains in between.
+//    Returns the steps learned (and the episodes, if you ask), or -1 if
+//    the log can't be read or is for a different number of actions.
+//    Episodes with a state or action out of the brain's range are
+//    skipped (and counted on stderr).
+long bz_replaylog (bz_brain *brain, const char *filename, long *episodes) {
+  bz_logreader *r;
+  bz__logrec *first, *end, *rec;
+  long steps, i, total, eps, skipped;
+  r = bz_openreplay (filename);
+  if (r == NULL) return (-1);
+  if (r->maxactions != brain->maxactions) {
+    bz_closereplay (r);
+    return (-1);
+  }
+  total = eps = skipped = 0;
+  while (bz__nextepisode (r, &first, &steps, &end)) {
+    if ( ! bz__logepisodefits (r, brain, first, steps)) {
+      skipped++;
+      continue;
+    }
+    BZ__COUNT (brain, chains, 1);
+    BZ__COUNT (brain, chainlinks, steps);
+    BZ__MAXCHAIN (brain, steps);
+    for (i = 0; i < steps; i++) {
+      rec = (bz__logrec *) ((char *) first + i * r->recsize);
+      bz_learnstateaction_bits (brain, rec->state, rec->action,
+				BZ__LOGMASK (rec), end->add, end->multiply,
+				NULL);
+    }
+    total += steps;
+    eps++;
+  }
+  if (skipped)
+    fprintf (stderr, "BZERKER - skipped %ld logged episodes that didn't fit"
+	     " the brain\n", skipped);
+  bz_closereplay (r);
+  if (episodes) *episodes = eps;
+  return (total);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+//      Deltas - replicas of a brain training apart and merging
+//
+////////////////////////////////////////////////////////////////////////
 //
-//    Don't call these unless you absolutely have to
+//    A bz_sync remembers what every row of its brain looked like at the
+//    last exchange (the base), and a dirty bit per row says which ones
+//    have been learned into since.   A delta is just those rows, as
+//    (now - base), each packed into 16-bit steps with one float scale
+//    per row, the same trick BZ_BRAIN_COMPACT plays:
+//
+//        a 32-byte bz__deltahead, then nrows records of
+//        int64 state, float scale, int16 steps[maxactions]
+//
+//    Encoding moves the base on by exactly what was sent, so whatever
+//    the 16 bits couldn't carry is still (now - base) and goes out the
+//    next time that row is touched.   Merging moves the row and the
+//    base together, so a replica never sends back what it was sent.
+//    Byte order is this machine's, like brain files.
+
+static const char bz__deltamagic[8] = { 'B', 'Z', 'D', 'E', 'L', 'T', 'A', 0 };
+#define BZ_DELTA_VERSION 1
+
+typedef struct bz__deltahead {
+  char magic[8];
+  uint32_t version;        //  BZ_DELTA_VERSION
+  uint32_t byteorder;      //  0x01020304 as written by this machine
+  int32_t maxstates;
+  int32_t maxactions;
+  int64_t nrows;
+} bz__deltahead;
+
+#define BZ__DELTAREC(actions) (sizeof (int64_t) + sizeof (float)	\
+			       + sizeof (int16_t) * (actions))
+
+struct bz__sync {
+  bz_brain *brain;
+  struct bz__tracker tracker;
+  float *base;                //  maxstates * maxactions
+};
+
+//    Hook a tracker onto a brain, or take it off again.   Do this while
+//    nobody is learning into the brain.
+static int bz__track (bz_brain *brain, struct bz__tracker *t) {
+  if (brain->hash || brain->factors) {
+    fprintf (stderr, "BZERKER - only dense brains can track dirty rows.\n");
+    return (1);
+  }
+  t->bits = calloc ((brain->maxstates + 63) / 64, sizeof (uint64_t));
+  if (t->bits == NULL) return (1);
+  t->next = brain->trackers;
+  brain->trackers = t;
+  return (0);
+}
+
+static void bz__untrack (bz_brain *brain, struct bz__tracker *t) {
+  struct bz__tracker **tp;
+  for (tp = &brain->trackers; *tp; tp = &(*tp)->next)
+    if (*tp == t) {
+      *tp = t->next;
+      break;
+    }
+  free (t->bits);
+}
+
+//    Take (and clear) 64 rows' worth of dirty bits.
+static inline uint64_t bz__takedirty (bz_brain *brain, struct bz__tracker *t,
+				      long word) {
+  if (brain->locks)
+    return (__atomic_exchange_n (&t->bits[word], 0, __ATOMIC_RELAXED));
+  uint64_t bits = t->bits[word];
+  t->bits[word] = 0;
+  return (bits);
+}
+
+bz_sync *bz_newsync (bz_brain *brain) {
+  bz_sync *sync;
+  float rowbuf[brain->maxactions];
+  float *row;
+  long s;
+  BZ_TRACE ("newsync called\n");
+  sync = malloc (sizeof (bz_sync));
+  if (sync == NULL) return (NULL);
+  sync->brain = brain;
+  sync->base = malloc (sizeof (float) * brain->maxstates * brain->maxactions);
+  if (sync->base == NULL || bz__track (brain, &sync->tracker)) {
+    free (sync->base);
+    free (sync);
+    return (NULL);
+  }
+  for (s = 0; s < brain->maxstates; s++) {
+    bz__lockrow (brain, s);
+    row = bz__row (brain, s, rowbuf);
+    memcpy (&sync->base[s * brain->maxactions], row,
+	    sizeof (float) * brain->maxactions);
+    bz__unlockrow (brain, s);
+  }
+  return (sync);
+}
+
+long bz_deltaencode (bz_sync *sync, void **delta) {
+  bz_brain *brain;
+  bz__deltahead *head;
+  uint64_t *taken, bits;
+  float rowbuf[sync->brain->maxactions];
+  float *row, *base, d, maxabs, scale;
+  int16_t q;
+  char *rec;
+  long words, w, s, nrows, recsize;
+  int a;
+  BZ_TRACE ("deltaencode called\n");
+  brain = sync->brain;
+  *delta = NULL;
+  words = (brain->maxstates + 63) / 64;
+  taken = malloc (sizeof (uint64_t) * words);
+  if (taken == NULL) return (-1);
+  nrows = 0;
+  for (w = 0; w < words; w++) {
+    taken[w] = bz__takedirty (brain, &sync->tracker, w);
+    nrows += __builtin_popcountll (taken[w]);
+  }
+  recsize = BZ__DELTAREC (brain->maxactions);
+  head = malloc (sizeof (bz__deltahead) + nrows * recsize);
+  if (head == NULL) {
+    //   put them back so nothing is lost
+    for (w = 0; w < words; w++)
+      if (taken[w]) __atomic_fetch_or (&sync->tracker.bits[w], taken[w],
+				       __ATOMIC_RELAXED);
+    free (taken);
+    return (-1);
+  }
+  memset (head, 0, sizeof (bz__deltahead));
+  memcpy (head->magic, bz__deltamagic, sizeof (bz__deltamagic));
+  head->version = BZ_DELTA_VERSION;
+  head->byteorder = 0x01020304;
+  head->maxstates = brain->maxstates;
+  head->maxactions = brain->maxactions;
+  rec = (char *) (head + 1);
+  nrows = 0;
+  for (w = 0; w < words; w++) {
+    for (bits = taken[w]; bits; bits &= bits - 1) {
+      s = w * 64 + __builtin_ctzll (bits);
+      base = &sync->base[s * brain->maxactions];
+      bz__lockrow (brain, s);
+      row = bz__row (brain, s, rowbuf);
+      maxabs = 0;
+      for (a = 0; a < brain->maxactions; a++) {
+	d = fabsf (row[a] - base[a]);
+	if (d > maxabs) maxabs = d;
+      }
+      if (maxabs == 0) {      //  learned, but back where it was
+	bz__unlockrow (brain, s);
+	continue;
+      }
+      scale = maxabs / 32767;
+      memcpy (rec, &(int64_t) { s }, sizeof (int64_t));
+      memcpy (rec + sizeof (int64_t), &scale, sizeof (float));
+      for (a = 0; a < brain->maxactions; a++) {
+	q = lrintf ((row[a] - base[a]) / scale);
+	base[a] += q * scale;
+	memcpy (rec + sizeof (int64_t) + sizeof (float) + a * sizeof (int16_t),
+		&q, sizeof (int16_t));
+      }
+      bz__unlockrow (brain, s);
+      rec += recsize;
+      nrows++;
+    }
+  }
+  free (taken);
+  head->nrows = nrows;
+  *delta = head;
+  return (sizeof (bz__deltahead) + nrows * recsize);
+}
+
+long bz_deltamerge (bz_sync *sync, const void *delta, long len, float weight) {
+  bz_brain *brain;
+  const bz__deltahead *head;
+  const char *rec;
+  float rowbuf[sync->brain->maxactions];
+  float *row, *base, scale, old;
+  int64_t s;
+  int16_t q;
+  long i, recsize;
+  int a;
+  BZ_TRACE ("deltamerge called\n");
+  brain = sync->brain;
+  head = delta;
+  recsize = BZ__DELTAREC (brain->maxactions);
+  if (len < (long) sizeof (bz__deltahead)
+      || memcmp (head->magic, bz__deltamagic, sizeof (bz__deltamagic)) != 0
+      || head->version != BZ_DELTA_VERSION
+      || head->byteorder != 0x01020304
+      || head->maxstates != brain->maxstates
+      || head->maxactions != brain->maxactions
+      || head->nrows < 0
+      || len != (long) sizeof (bz__deltahead) + head->nrows * recsize) {
+    fprintf (stderr, "BZERKER - that delta isn't for this brain.\n");
+    return (-1);
+  }
+  //   every state checked before anything is touched, so a bad delta
+  //   leaves the brain as it was rather than half merged
+  rec = (const char *) (head + 1);
+  for (i = 0; i < head->nrows; i++, rec += recsize) {
+    memcpy (&s, rec, sizeof (int64_t));
+    if (s < 0 || s >= brain->maxstates) {
+      fprintf (stderr, "BZERKER - delta row %ld has state %ld, out of range;"
+	       " nothing merged.\n", i, (long) s);
+      return (-1);
+    }
+  }
+  rec = (const char *) (head + 1);
+  for (i = 0; i < head->nrows; i++, rec += recsize) {
+    memcpy (&s, rec, sizeof (int64_t));
+    memcpy (&scale, rec + sizeof (int64_t), sizeof (float));
+    base = &sync->base[s * brain->maxactions];
+    bz__lockrow (brain, s);
+    row = bz__row (brain, s, rowbuf);
+    //   like bz__invalidate, but our own tracker mustn't count the merge
+    //   as a change to send back out
+    if (brain->infer) brain->infer->valid[s] = 0;
+    bz__marktrackers (brain, s, &sync->tracker);
+    for (a = 0; a < brain->maxactions; a++) {
+      memcpy (&q, rec + sizeof (int64_t) + sizeof (float)
+	      + a * sizeof (int16_t), sizeof (int16_t));
+      old = row[a];
+      row[a] += weight * q * scale;
+      //   same floor as learning
+      if (row[a] < TOKENMIN) row[a] = TOKENMIN;
+      base[a] += row[a] - old;
+    }
+    bz__rowdone (brain, s, row);
+    bz__unlockrow (brain, s);
+  }
+  return (head->nrows);
+}
+
+void bz_killsync (bz_sync *sync) {
+  if (sync == NULL) return;
+  bz__untrack (sync->brain, &sync->tracker);
+  free (sync->base);
+  free (sync);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+//      Checkpoints - a live brain, saved a few changed rows at a time
+//
+////////////////////////////////////////////////////////////////////////
+//
+//    The checkpoint is an ordinary brain file plus "<file>.bzpatch": a
+//    64-byte bz__patchhead, then fixed-size records of an int64 state
+//    and maxactions floats, that row's tokens as they were when copied.
+//    A record with state -1 ends a round; a round is only believed once
+//    its end record (and everything before it) has been fsync'd, so a
+//    crash mid-round just loses that round.   Rows are whole values,
+//    not changes, so applying a round twice does no harm - which is
+//    what makes folding the patches back into the brain file safe: the
+//    brain file is rewritten (from the checkpointer's own shadow copy,
+//    never the live brain) and renamed into place first, and the patch
+//    file emptied after.
+//
+//    The actors never wait for more than one row: the writer thread
+//    takes the dirty bits, copies each dirty row under its stripe lock,
+//    and does everything else on its own time.
+
+static const char bz__patchmagic[8] = { 'B', 'Z', 'P', 'A', 'T', 'C', 'H', 0 };
+#define BZ_PATCH_VERSION 1
+
+typedef struct bz__patchhead {
+  char magic[8];
+  uint32_t version;        //  BZ_PATCH_VERSION
+  uint32_t byteorder;      //  0x01020304 as written by this machine
+  int32_t maxstates;
+  int32_t maxactions;
+  char pad[40];
+} bz__patchhead;
+
+#define BZ__PATCHREC(actions) (sizeof (int64_t) + sizeof (float) * (actions))
+
+struct bz__checkpointer {
+  bz_brain *brain;
+  struct bz__tracker tracker;
+  bz_brain *shadow;        //  what's on disk, base and patches together
+  char *filename;
+  FILE *patch;
+  long patchrows;          //  rows in the patch file since it was emptied
+  double seconds;
+  int stopping;
+  pthread_t thread;
+  pthread_mutex_t lock;    //  one round at a time, and guards stopping
+  pthread_cond_t wake;
+};
+
+static void bz__patchname (char *name, const char *filename) {
+  sprintf (name, "%s.bzpatch", filename);
+}
+
+static int bz__writepatchhead (FILE *f, bz_brain *brain) {
+  bz__patchhead head;
+  memset (&head, 0, sizeof (head));
+  memcpy (head.magic, bz__patchmagic, sizeof (bz__patchmagic));
+  head.version = BZ_PATCH_VERSION;
+  head.byteorder = 0x01020304;
+  head.maxstates = brain->maxstates;
+  head.maxactions = brain->maxactions;
+  return (fwrite (&head, sizeof (head), 1, f) != 1
+	  || fflush (f) != 0 || fsync (fileno (f)) != 0);
+}
+
+//    One round: copy out the dirty rows, make them durable, and fold
+//    the patches back into the brain file once they outgrow it.
+//    Called with cp->lock held.
+static int bz__checkpointround (bz_checkpointer *cp) {
+  bz_brain *brain;
+  float rowbuf[cp->brain->maxactions];
+  float shadowbuf[cp->brain->maxactions];
+  float *row, *shadowrow;
+  uint64_t bits;
+  int64_t s;
+  long words, w, n;
+  int ok;
+  char name[strlen (cp->filename) + 16];
+  brain = cp->brain;
+  words = (brain->maxstates + 63) / 64;
+  n = 0;
+  ok = 1;
+  for (w = 0; w < words; w++) {
+    for (bits = bz__takedirty (brain, &cp->tracker, w); bits;
+	 bits &= bits - 1) {
+      s = w * 64 + __builtin_ctzll (bits);
+      bz__lockrow (brain, s);
+      row = bz__row (brain, s, rowbuf);
+      shadowrow = bz__row (cp->shadow, s, shadowbuf);
+      memcpy (shadowrow, row, sizeof (float) * brain->maxactions);
+      bz__unlockrow (brain, s);
+      bz__rowdone (cp->shadow, s, shadowrow);
+      ok = ok && fwrite (&s, sizeof (s), 1, cp->patch) == 1
+	&& fwrite (shadowrow, sizeof (float), brain->maxactions, cp->patch)
+	== (size_t) brain->maxactions;
+      n++;
+    }
+  }
+  if (n == 0) return (0);
+  //   the end-of-round record (its floats are just padding)
+  s = -1;
+  memset (rowbuf, 0, sizeof (rowbuf));
+  ok = ok && fwrite (&s, sizeof (s), 1, cp->patch) == 1
+    && fwrite (rowbuf, sizeof (float), brain->maxactions, cp->patch)
+    == (size_t) brain->maxactions
+    && fflush (cp->patch) == 0 && fsync (fileno (cp->patch)) == 0;
+  if ( ! ok) {
+    fprintf (stderr, "BZERKER - couldn't write checkpoint patches for %s\n",
+	     cp->filename);
+    return (1);
+  }
+  cp->patchrows += n;
+  if (cp->patchrows > brain->maxstates) {
+    if (bz_savebrain (cp->shadow, cp->filename) != 0) {
+      fprintf (stderr, "BZERKER - couldn't rewrite checkpoint %s\n",
+	       cp->filename);
+      return (1);
+    }
+    bz__patchname (name, cp->filename);
+    fclose (cp->patch);
+    cp->patch = fopen (name, "wb");
+    if (cp->patch == NULL || bz__writepatchhead (cp->patch, brain)) {
+      fprintf (stderr, "BZERKER - couldn't restart checkpoint patches %s\n",
+	       name);
+      return (1);
+    }
+    cp->patchrows = 0;
+  }
+  return (0);
+}
+
+static void *bz__checkpointthread (void *arg) {
+  bz_checkpointer *cp;
+  struct timespec until;
+  double whole;
+  cp = (bz_checkpointer *) arg;
+  pthread_mutex_lock (&cp->lock);
+  while ( ! cp->stopping) {
+    clock_gettime (CLOCK_REALTIME, &until);
+    until.tv_nsec += (long) (modf (cp->seconds, &whole) * 1e9);
+    until.tv_sec += (time_t) whole + until.tv_nsec / 1000000000;
+    until.tv_nsec %= 1000000000;
+    while ( ! cp->stopping
+	    && pthread_cond_timedwait (&cp->wake, &cp->lock, &until) == 0) ;
+    if (cp->patch) bz__checkpointround (cp);
+  }
+  pthread_mutex_unlock (&cp->lock);
+  return (NULL);
+}
+
+bz_checkpointer *bz_newcheckpointer (bz_brain *brain, const char *filename,
+				     double seconds) {
+  bz_checkpointer *cp;
+  char name[strlen (filename) + 16];
+  BZ_TRACE ("newcheckpointer called\n");
+  //   the writer and the actors are all in this brain at once now
+  if (bz_sharebrain (brain, 1024)) return (NULL);
+  cp = calloc (1, sizeof (bz_checkpointer));
+  if (cp == NULL) return (NULL);
+  cp->brain = brain;
+  cp->seconds = seconds > 0 ? seconds : 60;
+  cp->filename = strdup (filename);
+  bz__patchname (name, filename);
+  if (cp->filename == NULL
+      || bz_savebrain (brain, filename) != 0
+      || (cp->shadow = bz_loadbrain (filename)) == NULL
+      || (cp->patch = fopen (name, "wb")) == NULL
+      || bz__writepatchhead (cp->patch, brain)
+      || bz__track (brain, &cp->tracker)) {
+    fprintf (stderr, "BZERKER - couldn't start a checkpoint in %s\n",
+	     filename);
+    if (cp->patch) fclose (cp->patch);
+    if (cp->shadow) bz_killbrain (cp->shadow);
+    free (cp->filename);
+    free (cp);
+    return (NULL);
+  }
+  pthread_mutex_init (&cp->lock, NULL);
+  pthread_cond_init (&cp->wake, NULL);
+  if (pthread_create (&cp->thread, NULL, bz__checkpointthread, cp) != 0) {
+    fprintf (stderr, "BZERKER - couldn't start the checkpoint thread\n");
+    bz__untrack (brain, &cp->tracker);
+    fclose (cp->patch);
+    bz_killbrain (cp->shadow);
+    free (cp->filename);
+    free (cp);
+    return (NULL);
+  }
+  return (cp);
+}
+
+int bz_checkpointnow (bz_checkpointer *cp) {
+  int r;
+  pthread_mutex_lock (&cp->lock);
+  r = bz__checkpointround (cp);
+  pthread_mutex_unlock (&cp->lock);
+  return (r);
+}
+
+int bz_killcheckpointer (bz_checkpointer *cp) {
+  int r;
+  if (cp == NULL) return (0);
+  pthread_mutex_lock (&cp->lock);
+  cp->stopping = 1;
+  pthread_cond_signal (&cp->wake);
+  pthread_mutex_unlock (&cp->lock);
+  pthread_join (cp->thread, NULL);
+  //   one last round, so the checkpoint is the brain as it is now
+  r = bz__checkpointround (cp);
+  bz__untrack (cp->brain, &cp->tracker);
+  if (fclose (cp->patch) != 0) r = 1;
+  bz_killbrain (cp->shadow);
+  pthread_mutex_destroy (&cp->lock);
+  pthread_cond_destroy (&cp->wake);
+  free (cp->filename);
+  free (cp);
+  return (r);
+}
+
+bz_brain *bz_loadcheckpoint (const char *filename) {
+  bz_brain *brain;
+  bz__patchhead head;
+  char name[strlen (filename) + 16];
+  float *row;
+  char *recs, *rec, *end;
+  long len, recsize, applied;
+  int64_t s;
+  FILE *f;
+  BZ_TRACE ("loadcheckpoint called\n");
+  brain = bz_loadbrain (filename);
+  if (brain == NULL) return (NULL);
+  bz__patchname (name, filename);
+  f = fopen (name, "rb");
+  if (f == NULL) return (brain);     //  no patches, nothing to do
+  recsize = BZ__PATCHREC (brain->maxactions);
+  if (fread (&head, sizeof (head), 1, f) != 1
+      || memcmp (head.magic, bz__patchmagic, sizeof (bz__patchmagic)) != 0
+      || head.version != BZ_PATCH_VERSION
+      || head.byteorder != 0x01020304
+      || head.maxstates != brain->maxstates
+      || head.maxactions != brain->maxactions) {
+    //   a header that never made it to disk means no rounds did either
+    fclose (f);
+    return (brain);
+  }
+  fseek (f, 0, SEEK_END);
+  len = ftell (f) - sizeof (head);
+  fseek (f, sizeof (head), SEEK_SET);
+  recs = malloc (len > 0 ? len : 1);
+  if (recs == NULL || fread (recs, 1, len, f) != (size_t) len) {
+    free (recs);
+    fclose (f);
+    bz_killbrain (brain);
+    return (NULL);
+  }
+  fclose (f);
+  //   only up to the last whole round counts
+  end = recs;
+  for (rec = recs; rec + recsize <= recs + len; rec += recsize) {
+    memcpy (&s, rec, sizeof (s));
+    if (s == -1) end = rec + recsize;
+  }
+  applied = 0;
+  float rowbuf[brain->maxactions];
+  for (rec = recs; rec < end; rec += recsize) {
+    memcpy (&s, rec, sizeof (s));
+    if (s < 0 || s >= brain->maxstates) continue;
+    row = bz__row (brain, s, rowbuf);
+    memcpy (row, rec + sizeof (s), sizeof (float) * brain->maxactions);
+    bz__rowdone (brain, s, row);
+    applied++;
+  }
+  BZ_TRACE ("checkpoint: %ld patched rows\n", applied);
+  free (recs);
+  return (brain);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+//      Parallel training - a pool of workers each playing whole episodes
+//
+////////////////////////////////////////////////////////////////////////
+
+typedef struct bz__trainer {
+  long episodes;
+  long next_episode;     //  claimed with an atomic fetch-and-add
+  long done;
+  int stop;              //  set once an episode asks us to stop
+  unsigned long seed;
+  bz_episode_fn episode;
+  void *userdata;
+} bz__trainer;
+
+typedef struct bz__worker {
+  bz__trainer *trainer;
+  int worker;
+  bz_rng rng;
+  pthread_t thread;
+} bz__worker;
+
+static void *bz__trainworker (void *arg) {
+  bz__worker *w;
+  bz__trainer *t;
+  long ep;
+  w = (bz__worker *) arg;
+  t = w->trainer;
+  //  Hand out episodes one at a time - they're short, and this keeps all
+  //  the workers busy right up to the end without any batch tuning.
+  //  An episode that returns nonzero stops the handing out; whatever the
+  //  others are in the middle of still finishes.
+  while (!__atomic_load_n (&t->stop, __ATOMIC_RELAXED)
+	 && (ep = __atomic_fetch_add (&t->next_episode, 1, __ATOMIC_RELAXED))
+	 < t->episodes) {
+    if (t->episode (t->userdata, w->worker, &w->rng, ep))
+      __atomic_store_n (&t->stop, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&t->done, 1, __ATOMIC_RELAXED);
+  }
+  return (NULL);
+}
+
+long bz_trainparallel (int nthreads,
+		       long episodes,
+		       unsigned long seed,
+		       bz_episode_fn episode,
+		       void *userdata)
+{
+  bz__trainer trainer;
+  bz__worker *workers;
+  int i, started;
+  BZ_TRACE ("trainparallel called\n");
+  if (nthreads < 1) nthreads = 1;
+  trainer.episodes = episodes;
+  trainer.next_episode = 0;
+  trainer.done = 0;
+  trainer.stop = 0;
+  trainer.seed = seed;
+  trainer.episode = episode;
+  trainer.userdata = userdata;
+  workers = malloc (sizeof (bz__worker) * nthreads);
+  if (workers == NULL) return (0);
+  for (i = 0; i < nthreads; i++) {
+    workers[i].trainer = &trainer;
+    workers[i].worker = i;
+    bz_rng_seed (&workers[i].rng, seed + i);
+  }
+  if (nthreads == 1) {
+    //   No threads at all - same results as a plain loop would give.
+    bz__trainworker (&workers[0]);
+  } else {
+    //   Worker 0 is the calling thread itself.
+    started = 1;
+    for (i = 1; i < nthreads; i++) {
+      if (pthread_create (&workers[i].thread, NULL,
+			  bz__trainworker, &workers[i]) != 0) {
+	fprintf (stderr, "BZERKER - couldn't start trainer thread %d\n", i);
+	break;
+      }
+      started++;
+    }
+    bz__trainworker (&workers[0]);
+    for (i = 1; i < started; i++)
+      pthread_join (workers[i].thread, NULL);
+  }
+  free (workers);
+  return (trainer.done);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+//      Monitoring - how training is going, and when it's gone far enough
+//
+////////////////////////////////////////////////////////////////////////
+
+struct bz__monitor {
+  int noutcomes;
+  long window;           //  outcomes the rates are taken over
+  long every;            //  outcomes between checks
+  bz_stop_fn stop;
+  void *userdata;
+  unsigned char *ring;   //  the last "window" outcomes; BZ__NOOUTCOME if none
+  long recorded;         //  outcomes so far (atomic)
+  long stoppedat;        //  outcomes when stop() said yes, 0 until then
+  pthread_mutex_t lock;  //  held for a check
+  int nbrains;
+  bz_brain *brains[BZ_MONMAXBRAINS];
+  uint64_t decisions[BZ_MONMAXBRAINS];    //  counters at the last check
+  uint64_t underflows[BZ_MONMAXBRAINS];
+  bz_monstats stats;     //  as of the last check
+};
+
+#define BZ__NOOUTCOME 255
+
+bz_monitor *bz_newmonitor (int noutcomes, long window, long every,
+			   bz_stop_fn stop, void *userdata) {
+  bz_monitor *mon;
+  BZ_TRACE ("newmonitor called\n");
+  if (noutcomes < 1 || noutcomes > BZ_MONMAXOUTCOMES || window < 1) {
+    fprintf (stderr, "BZERKER - a monitor needs 1 to %d outcomes and a window\n",
+	     BZ_MONMAXOUTCOMES);
+    return (NULL);
+  }
+  mon = calloc (1, sizeof (bz_monitor));
+  if (mon == NULL) return (NULL);
+  mon->ring = malloc (window);
+  if (mon->ring == NULL) {
+    fprintf (stderr, "BZERKER - no memory for a %ld outcome window\n", window);
+    free (mon);
+    return (NULL);
+  }
+  memset (mon->ring, BZ__NOOUTCOME, window);
+  mon->noutcomes = noutcomes;
+  mon->window = window;
+  mon->every = every > 0 ? every : window;
+  mon->stop = stop;
+  mon->userdata = userdata;
+  pthread_mutex_init (&mon->lock, NULL);
+  mon->stats.noutcomes = noutcomes;
+  return (mon);
+}
+
+int bz_monitorbrain (bz_monitor *mon, bz_brain *brain) {
+  bz_counters c;
+  if (mon->nbrains == BZ_MONMAXBRAINS) {
+    fprintf (stderr, "BZERKER - a monitor only watches %d brains\n",
+	     BZ_MONMAXBRAINS);
+    return (1);
+  }
+  pthread_mutex_lock (&mon->lock);
+  bz_getcounters (brain, &c);
+  mon->brains[mon->nbrains] = brain;
+  mon->decisions[mon->nbrains] = c.decisions;
+  mon->underflows[mon->nbrains] = c.underflows;
+  mon->nbrains++;
+  pthread_mutex_unlock (&mon->lock);
+  return (0);
+}
+
+//    Entropy of one row, as a fraction of the most it could have (all
+//    boxes alike is 1, everything on one box is 0).   Rows still exactly
+//    as they started are left out, so a brain that's only seen a corner
+//    of its states isn't made to look undecided by all the rest.
+static int bz__rowentropy (bz_brain *brain, const float *row, double *h) {
+  double sum, e, p;
+  int i, fresh;
+  sum = 0;
+  fresh = 1;
+  for (i = 0; i < brain->maxactions; i++) {
+    sum += row[i];
+    if (row[i] != brain->starting_tokens) fresh = 0;
+  }
+  if (fresh || sum <= 0) return (0);
+  e = 0;
+  for (i = 0; i < brain->maxactions; i++)
+    if (row[i] > 0) {
+      p = row[i] / sum;
+      e -= p * log (p);
+    }
+  *h += brain->maxactions > 1 ? e / log (brain->maxactions) : 0;
+  return (1);
+}
+
+//    Add up a brain's row entropies (and how many rows), factor by
+//    factor for a factored brain.
+static void bz__brainentropy (bz_brain *brain, double *h, long *rows) {
+  float scratch[brain->maxactions], *row;
+  long s;
+  int i;
+  if (brain->factors) {
+    for (i = 0; i < brain->factors->count; i++)
+      bz__brainentropy (brain->factors->brains[i], h, rows);
+    return;
+  }
+  if (brain->hash) {
+    //   (hashed brains aren't shared, so nobody's moving the table)
+    for (s = 0; s < brain->hash->capacity; s++)
+      if (brain->hash->keys[s] != BZ__NOKEY)
+	*rows += bz__rowentropy (brain,
+				 &brain->hash->rows[s * brain->maxactions], h);
+    return;
+  }
+  for (s = 0; s < brain->maxstates; s++) {
+    bz__lockrow (brain, s);
+    row = bz__row (brain, s, scratch);
+    if (row != scratch) {
+      memcpy (scratch, row, sizeof (float) * brain->maxactions);
+      row = scratch;
+    }
+    bz__unlockrow (brain, s);
+    *rows += bz__rowentropy (brain, row, h);
+  }
+}
+
+//    A check, with mon->lock held: count up the window, take the
+//    counters' progress since last time, and ask stop().
+static void bz__monitorcheck (bz_monitor *mon) {
+  long counts[BZ_MONMAXOUTCOMES], n, i, rows;
+  uint64_t d, u, decisions, underflows;
+  bz_counters now;
+  double h;
+  int b, o;
+  bz_monstats *st;
+  st = &mon->stats;
+  st->episodes = __atomic_load_n (&mon->recorded, __ATOMIC_RELAXED);
+  n = st->episodes < mon->window ? st->episodes : mon->window;
+  for (o = 0; o < mon->noutcomes; o++) counts[o] = 0;
+  st->window = 0;
+  for (i = 0; i < n; i++) {
+    o = __atomic_load_n (&mon->ring[i], __ATOMIC_RELAXED);
+    if (o == BZ__NOOUTCOME) continue;  //  claimed but not written yet
+    counts[o]++;
+    st->window++;
+  }
+  for (o = 0; o < mon->noutcomes; o++)
+    st->rate[o] = st->window ? (double) counts[o] / st->window : 0;
+
+  decisions = underflows = 0;
+  h = 0;
+  rows = 0;
+  for (b = 0; b < mon->nbrains; b++) {
+    bz_getcounters (mon->brains[b], &now);
+    d = now.decisions;
+    u = now.underflows;
+    //   (somebody may have bz_resetcounters'd in between)
+    decisions += d >= mon->decisions[b] ? d - mon->decisions[b] : d;
+    underflows += u >= mon->underflows[b] ? u - mon->underflows[b] : u;
+    mon->decisions[b] = d;
+    mon->underflows[b] = u;
+    bz__brainentropy (mon->brains[b], &h, &rows);
+  }
+  st->underflowrate = decisions ? (double) underflows / decisions : 0;
+  st->entropy = rows ? h / rows : 1.0;
+  st->rows = rows;
+  if (mon->stoppedat == 0 && mon->stop && mon->stop (st, mon->userdata)) {
+    __atomic_store_n (&mon->stoppedat, st->episodes > 0 ? st->episodes : 1,
+		      __ATOMIC_RELAXED);
+    BZ_TRACE ("monitor says stop\n");
+  }
+}
+
+int bz_monitorrecord (bz_monitor *mon, int outcome) {
+  long n;
+  n = __atomic_fetch_add (&mon->recorded, 1, __ATOMIC_RELAXED);
+  __atomic_store_n (&mon->ring[n % mon->window],
+		    (outcome >= 0 && outcome < mon->noutcomes)
+		    ? (unsigned char) outcome : BZ__NOOUTCOME,
+		    __ATOMIC_RELAXED);
+  //   Whoever records the every'th outcome does the check - unless the
+  //   last one is still going, in which case we just skip this one.
+  if ((n + 1) % mon->every == 0 && pthread_mutex_trylock (&mon->lock) == 0) {
+    bz__monitorcheck (mon);
+    pthread_mutex_unlock (&mon->lock);
+  }
+  return (__atomic_load_n (&mon->stoppedat, __ATOMIC_RELAXED) != 0);
+}
+
+int bz_monitorcheck (bz_monitor *mon, bz_monstats *stats) {
+  pthread_mutex_lock (&mon->lock);
+  bz__monitorcheck (mon);
+  if (stats) *stats = mon->stats;
+  pthread_mutex_unlock (&mon->lock);
+  return (mon->stoppedat != 0);
+}
+
+void bz_monitorstats (bz_monitor *mon, bz_monstats *stats) {
+  pthread_mutex_lock (&mon->lock);
+  *stats = mon->stats;
+  pthread_mutex_unlock (&mon->lock);
+}
+
+long bz_monitorstopped (bz_monitor *mon) {
+  return (__atomic_load_n (&mon->stoppedat, __ATOMIC_RELAXED));
+}
+
+void bz_killmonitor (bz_monitor *mon) {
+  if (mon == NULL) return;
+  pthread_mutex_destroy (&mon->lock);
+  free (mon->ring);
+  free (mon);
+}
+
+int bz_stoprate (const bz_monstats *stats, void *rule) {
+  bz_stoprule *r;
+  r = (bz_stoprule *) rule;
+  if (stats->window < r->minwindow || stats->window == 0) return (0);
+  if (r->outcome < 0 || r->outcome >= stats->noutcomes) return (0);
+  return (stats->rate[r->outcome] >= r->minrate
+	  && stats->underflowrate <= r->maxunderflow);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+//      Asynchronous learning - actors push, one learner thread applies
+//
+////////////////////////////////////////////////////////////////////////
+//
+//    The queue is a bounded ring with a sequence number in every slot
+//    (Vyukov's design).   Producers claim slots by bumping tail with a
+//    compare-and-swap, fill them in, then publish by setting the slot's
+//    sequence; the single consumer sees a slot is ready when its
+//    sequence catches up.   Nobody ever takes a lock to push.
+
+typedef struct bz__update {
+  long state;
+  int action;
+  int hasmask;
+  float add, multiply;
+  long order;           //  queue position, to keep same-state updates in order
+} bz__update;
+
+struct bz__learner {
+  bz_brain *brain;
+  long capacity;        //  power of two
+  long words;           //  mask words per slot
+  bz__update *slots;
+  bz_maskword *masks;   //  capacity * words
+  long *seq;
+  long tail;            //  next slot a producer will claim
+  long head;            //  next slot the learner will read (learner only)
+  long pushed, applied; //  updates queued and updates done
+  int stop;
+  pthread_t thread;
+  bz__update *batch;    //  the learner's sorting space
+  bz_maskword *batchmasks;
+};
+
+//    How many updates the learner takes (and sorts) at a time.
+#define BZ__LEARNBATCH 1024
+
+static int bz__updatecmp (const void *a, const void *b) {
+  const bz__update *x = a, *y = b;
+  if (x->state != y->state) return (x->state < y->state ? -1 : 1);
+  return (x->order < y->order ? -1 : x->order > y->order);
+}
+
+static void bz__backoff (int *spins) {
+  if ((*spins)++ < 64) return;
+  if (*spins < 256) sched_yield ();
+  else {
+    struct timespec ts = { 0, 50000 };
+    nanosleep (&ts, NULL);
+  }
+}
+
+static void *bz__learnerthread (void *arg) {
+  bz_learner *l;
+  bz_brain *brain;
+  long n, i, pos, slot, state;
+  int spins, stopping;
+  l = arg;
+  brain = l->brain;
+  spins = 0;
+  for (;;) {
+    stopping = __atomic_load_n (&l->stop, __ATOMIC_ACQUIRE);
+    //   take whatever's ready, up to a batch
+    n = 0;
+    while (n < BZ__LEARNBATCH) {
+      pos = l->head;
+      slot = pos & (l->capacity - 1);
+      if (__atomic_load_n (&l->seq[slot], __ATOMIC_ACQUIRE) != pos + 1)
+	break;
+      l->batch[n] = l->slots[slot];
+      l->batch[n].order = n;
+      memcpy (&l->batchmasks[n * l->words], &l->masks[slot * l->words],
+	      sizeof (bz_maskword) * l->words);
+      __atomic_store_n (&l->seq[slot], pos + l->capacity, __ATOMIC_RELEASE);
+      l->head = pos + 1;
+      n++;
+    }
+    if (n == 0) {
+      if (stopping) break;
+      bz__backoff (&spins);
+      continue;
+    }
+    spins = 0;
+    //   Grouped by state, each row gets pulled in (and locked) once per
+    //   batch, however many games went through it.   order still points
+    //   at each update's mask.
+    qsort (l->batch, n, sizeof (bz__update), bz__updatecmp);
+    for (i = 0; i < n; ) {
+      state = l->batch[i].state;
+      bz__lockrow (brain, state);
+      for ( ; i < n && l->batch[i].state == state; i++)
+	bz__learn (brain, state, l->batch[i].action, NULL,
+		   l->batch[i].hasmask
+		   ? &l->batchmasks[l->batch[i].order * l->words] : NULL,
+		   l->batch[i].add, l->batch[i].multiply);
+      bz__unlockrow (brain, state);
+    }
+    __atomic_fetch_add (&l->applied, n, __ATOMIC_RELEASE);
+  }
+  return (NULL);
+}
+
+bz_learner *bz_newlearner (bz_brain *brain, long capacity) {
+  bz_learner *l;
+  long i, cap;
+  BZ_TRACE ("newlearner called\n");
+  //   the learner and the actors are all in this brain at once now
+  if (bz_sharebrain (brain, 1024)) return (NULL);
+  for (cap = 2; cap < capacity; cap *= 2) ;
+  l = calloc (1, sizeof (bz_learner));
+  if (l == NULL) return (NULL);
+  l->brain = brain;
+  l->capacity = cap;
+  l->words = BZ_MASKWORDS (brain->maxactions);
+  l->slots = malloc (sizeof (bz__update) * cap);
+  l->masks = malloc (sizeof (bz_maskword) * cap * l->words);
+  l->seq = malloc (sizeof (long) * cap);
+  l->batch = malloc (sizeof (bz__update) * BZ__LEARNBATCH);
+  l->batchmasks = malloc (sizeof (bz_maskword) * BZ__LEARNBATCH * l->words);
+  if (!l->slots || !l->masks || !l->seq || !l->batch || !l->batchmasks)
+    goto fail;
+  for (i = 0; i < cap; i++) l->seq[i] = i;
+  if (pthread_create (&l->thread, NULL, bz__learnerthread, l) != 0)
+    goto fail;
+  return (l);
+ fail:
+  free (l->slots); free (l->masks); free (l->seq);
+  free (l->batch); free (l->batchmasks);
+  free (l);
+  return (NULL);
+}
+
+//    Queue one update; if the ring is full, wait for the learner.
+void bz_learnstateaction_async (bz_learner *l, long state, int action,
+				const bz_maskword *legalbits,
+				float add, float multiply) {
+  long pos, slot, seq;
+  int spins;
+  spins = 0;
+  pos = __atomic_load_n (&l->tail, __ATOMIC_RELAXED);
+  for (;;) {
+    slot = pos & (l->capacity - 1);
+    seq = __atomic_load_n (&l->seq[slot], __ATOMIC_ACQUIRE);
+    if (seq == pos) {
+      if (__atomic_compare_exchange_n (&l->tail, &pos, pos + 1, 1,
+				       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	break;
+    } else if (seq < pos) {
+      bz__backoff (&spins);      //  full: the learner's behind
+      pos = __atomic_load_n (&l->tail, __ATOMIC_RELAXED);
+    } else {
+      pos = __atomic_load_n (&l->tail, __ATOMIC_RELAXED);
+    }
+  }
+  l->slots[slot].state = state;
+  l->slots[slot].action = action;
+  l->slots[slot].add = add;
+  l->slots[slot].multiply = multiply;
+  l->slots[slot].hasmask = legalbits != NULL;
+  if (legalbits)
+    memcpy (&l->masks[slot * l->words], legalbits,
+	    sizeof (bz_maskword) * l->words);
+  __atomic_fetch_add (&l->pushed, 1, __ATOMIC_RELAXED);
+  __atomic_store_n (&l->seq[slot], pos + 1, __ATOMIC_RELEASE);
+}
+
+//    Queue a whole chain.   The links are copied, so the chain can be
+//    zeroed and reused the moment this returns.
+void bz_learnchain_async (bz_learner *l, bz_chain *chain,
+			  float add, float multiply) {
+  bz__chel *thischel;
+  bz_maskword bits[l->words];
+  bz_brain *brain;
+  brain = l->brain;
+  BZ__COUNT (brain, chains, 1);
+  BZ__COUNT (brain, chainlinks, chain->totalcount);
+  BZ__MAXCHAIN (brain, chain->totalcount);
+  for (thischel = chain->chels; thischel; thischel = thischel->next) {
+    if (thischel->mask) bz_maskbits (brain, thischel->mask, bits);
+    bz_learnstateaction_async (l, thischel->state, thischel->action,
+			       thischel->mask ? bits : NULL, add, multiply);
+  }
+}
+
+//    Wait until everything queued so far has been learned.
+void bz_learnerflush (bz_learner *l) {
+  long target;
+  int spins;
+  spins = 0;
+  target = __atomic_load_n (&l->pushed, __ATOMIC_ACQUIRE);
+  while (__atomic_load_n (&l->applied, __ATOMIC_ACQUIRE) < target)
+    bz__backoff (&spins);
+}
+
+//    Finish everything queued, stop the learner thread, and free it
+//    (the brain stays shared).
+void bz_killlearner (bz_learner *l) {
+  if (l == NULL) return;
+  bz_learnerflush (l);
+  __atomic_store_n (&l->stop, 1, __ATOMIC_RELEASE);
+  pthread_join (l->thread, NULL);
+  free (l->slots); free (l->masks); free (l->seq);
+  free (l->batch); free (l->batchmasks);
+  free (l);
+}
+
+////////////////////////////////////////////////////////////////////////
+//
+//      Real-time control - step a brain at a fixed rate, log on the side
+//
+////////////////////////////////////////////////////////////////////////
+//
+//    Telemetry uses the learner's kind of ring, but a full ring drops
+//    the record (and counts it) instead of waiting: the control loop
+//    must never stall on a slow disk.   One drain thread fwrite()s
+//    whatever's ready, a batch at a time.
+
+struct bz__telemetry {
+  FILE *file;
+  long capacity;          //  power of two
+  bz_telrecord *slots;
+  long *seq;
+  long tail;              //  next slot a producer will claim
+  long head;              //  next slot the drain will read (drain only)
+  long dropped;           //  records the ring had no room for
+  int stop;
+  int failed;             //  a write went wrong
+  pthread_t thread;
+};
+
+#define BZ__TELBATCH 256
+
+static void *bz__telemetrythread (void *arg) {
+  bz_telemetry *tel;
+  bz_telrecord batch[BZ__TELBATCH];
+  long n, pos, slot;
+  int spins, stopping;
+  tel = arg;
+  spins = 0;
+  for (;;) {
+    stopping = __atomic_load_n (&tel->stop, __ATOMIC_ACQUIRE);
+    n = 0;
+    while (n < BZ__TELBATCH) {
+      pos = tel->head;
+      slot = pos & (tel->capacity - 1);
+      if (__atomic_load_n (&tel->seq[slot], __ATOMIC_ACQUIRE) != pos + 1)
+	break;
+      batch[n++] = tel->slots[slot];
+      __atomic_store_n (&tel->seq[slot], pos + tel->capacity,
+			__ATOMIC_RELEASE);
+      tel->head = pos + 1;
+    }
+    if (n == 0) {
+      if (stopping) break;
+      bz__backoff (&spins);
+      continue;
+    }
+    spins = 0;
+    if (fwrite (batch, sizeof (bz_telrecord), n, tel->file) != (size_t) n)
+      tel->failed = 1;
+  }
+  return (NULL);
+}
+
+bz_telemetry *bz_newtelemetry (const char *filename, long capacity) {
+  bz_telemetry *tel;
+  long i, cap;
+  int32_t size;
+  BZ_TRACE ("newtelemetry called\n");
+  for (cap = 2; cap < capacity; cap *= 2) ;
+  tel = calloc (1, sizeof (bz_telemetry));
+  if (tel == NULL) return (NULL);
+  tel->capacity = cap;
+  tel->slots = malloc (sizeof (bz_telrecord) * cap);
+  tel->seq = malloc (sizeof (long) * cap);
+  if (!tel->slots || !tel->seq) goto fail;
+  for (i = 0; i < cap; i++) tel->seq[i] = i;
+  tel->file = fopen (filename, "wb");
+  if (tel->file == NULL) {
+    fprintf (stderr, "BZERKER - couldn't open telemetry file %s\n", filename);
+    goto fail;
+  }
+  //   the header: magic, then the record size so readers can check
+  size = sizeof (bz_telrecord);
+  if (fwrite (BZ_TELMAGIC, 1, 8, tel->file) != 8
+      || fwrite (&size, sizeof (size), 1, tel->file) != 1) {
+    fprintf (stderr, "BZERKER - couldn't write telemetry file %s\n", filename);
+    fclose (tel->file);
+    goto fail;
+  }
+  if (pthread_create (&tel->thread, NULL, bz__telemetrythread, tel) != 0) {
+    fclose (tel->file);
+    goto fail;
+  }
+  return (tel);
+ fail:
+  free (tel->slots);
+  free (tel->seq);
+  free (tel);
+  return (NULL);
+}
+
+int bz_telemetrypush (bz_telemetry *tel, const bz_telrecord *rec) {
+  long pos, slot, seq;
+  pos = __atomic_load_n (&tel->tail, __ATOMIC_RELAXED);
+  for (;;) {
+    slot = pos & (tel->capacity - 1);
+    seq = __atomic_load_n (&tel->seq[slot], __ATOMIC_ACQUIRE);
+    if (seq == pos) {
+      if (__atomic_compare_exchange_n (&tel->tail, &pos, pos + 1, 1,
+				       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	break;
+    } else if (seq < pos) {
+      __atomic_fetch_add (&tel->dropped, 1, __ATOMIC_RELAXED);
+      return (1);                //  full: the drain's behind, skip it
+    } else {
+      pos = __atomic_load_n (&tel->tail, __ATOMIC_RELAXED);
+    }
+  }
+  tel->slots[slot] = *rec;
+  __atomic_store_n (&tel->seq[slot], pos + 1, __ATOMIC_RELEASE);
+  return (0);
+}
+
+long bz_killtelemetry (bz_telemetry *tel) {
+  long dropped;
+  int failed;
+  if (tel == NULL) return (0);
+  __atomic_store_n (&tel->stop, 1, __ATOMIC_RELEASE);
+  pthread_join (tel->thread, NULL);
+  failed = tel->failed | (fclose (tel->file) != 0);
+  if (failed) fprintf (stderr, "BZERKER - telemetry didn't all get written\n");
+  dropped = tel->dropped;
+  free (tel->slots);
+  free (tel->seq);
+  free (tel);
+  return (failed ? -1 : dropped);
+}
+
+//    The controller: a brain, a ring chain of the last "memory" steps,
+//    and the clock.   Nothing in bz_step mallocs, locks (unless the
+//    brain is shared), or does I/O.
+struct bz__controller {
+  bz_brain *brain;
+  bz_chain *chain;
+  float evse, *evsep;     //  evsep is NULL for flat, else &evse
+  float multiply;
+  bz_telemetry *tel;
+  uint64_t steps;
+  struct timespec start;  //  when we were made
+  struct timespec next;   //  bz_waitstep's next deadline
+  long overruns;
+};
+
+static int64_t bz__nanos (const struct timespec *from) {
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return ((int64_t) (now.tv_sec - from->tv_sec) * 1000000000
+	  + (now.tv_nsec - from->tv_nsec));
+}
+
+bz_controller *bz_newcontroller (bz_brain *brain, int memory, float *evse,
+				 float multiply, bz_telemetry *tel) {
+  bz_controller *c;
+  BZ_TRACE ("newcontroller called\n");
+  if (memory < 1) {
+    fprintf (stderr, "BZERKER - a controller has to remember at least one step\n");
+    return (NULL);
+  }
+  c = calloc (1, sizeof (bz_controller));
+  if (c == NULL) return (NULL);
+  c->chain = bz_newringchain (brain, memory);
+  if (c->chain == NULL) {
+    free (c);
+    return (NULL);
+  }
+  c->brain = brain;
+  c->evse = evse ? *evse : 1.0;
+  c->evsep = evse ? &c->evse : NULL;
+  c->multiply = multiply;
+  c->tel = tel;
+  clock_gettime (CLOCK_MONOTONIC, &c->start);
+  c->next = c->start;
+  return (c);
+}
+
+//    One step of either kind: action < 0 means the brain picks, else
+//    it's what the caller already did and that's what gets remembered.
+static long bz__step (bz_controller *c, long state, float reward,
+		      long action, const bz_maskword *legalbits,
+		      const float *values, int nvalues) {
+  struct timespec t0;
+  bz_telrecord rec;
+  int i;
+  clock_gettime (CLOCK_MONOTONIC, &t0);
+  //   observe: the reward is for what the chain did to get us here, so
+  //   learn it once there's a whole memory's worth ...
+  if (c->chain->totalcount == c->chain->ringsize)
+    bz_learnchain (c->brain, c->chain, reward, c->multiply, NULL);
+  //   ... then act, and remember it
+  if (action < 0)
+    action = bz_nextaction_bits (c->brain, NULL, state, c->evsep, legalbits,
+				 NULL);
+  bz_addtochain_bits (c->chain, state, action, legalbits);
+  if (c->tel) {
+    rec.step = c->steps;
+    rec.nanos = (int64_t) (t0.tv_sec - c->start.tv_sec) * 1000000000
+      + (t0.tv_nsec - c->start.tv_nsec);
+    rec.state = state;
+    rec.action = action;
+    rec.reward = reward;
+    rec.latency = bz__nanos (&t0);
+    if (nvalues > BZ_TELMAXVALUES) nvalues = BZ_TELMAXVALUES;
+    rec.nvalues = values ? nvalues : 0;
+    for (i = 0; i < BZ_TELMAXVALUES; i++)
+      rec.values[i] = i < rec.nvalues ? values[i] : 0;
+    bz_telemetrypush (c->tel, &rec);
+  }
+  c->steps++;
+  return (action);
+}
+
+long bz_step (bz_controller *c, long state, float reward,
+	      const bz_maskword *legalbits, const float *values, int nvalues) {
+  return (bz__step (c, state, reward, -1, legalbits, values, nvalues));
+}
+
+long bz_steptaken (bz_controller *c, long state, float reward, long action,
+		   const bz_maskword *legalbits, const float *values,
+		   int nvalues) {
+  if (action < 0 || action >= c->brain->maxactions) {
+    fprintf (stderr,
+	     "BZERKER - action %ld out of range for this brain (0 to %d)\n",
+	     action, c->brain->maxactions - 1);
+    return (-1);
+  }
+  return (bz__step (c, state, reward, action, legalbits, values, nvalues));
+}
+
+long bz_waitstep (bz_controller *c, double period) {
+  long ns;
+  ns = period * 1e9;
+  c->next.tv_nsec += ns % 1000000000;
+  c->next.tv_sec += ns / 1000000000 + c->next.tv_nsec / 1000000000;
+  c->next.tv_nsec %= 1000000000;
+  //   Already past it?   Then we've overrun; start the beat again from
+  //   now rather than racing to catch up.
+  if (bz__nanos (&c->next) > 0) {
+    c->overruns++;
+    clock_gettime (CLOCK_MONOTONIC, &c->next);
+    return (c->overruns);
+  }
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &c->next, NULL)
+	 == EINTR) ;
+  return (c->overruns);
+}
+
+long bz_controllersteps (bz_controller *c) {
+  return (c->steps);
+}
+
+bz_chain *bz_controllerchain (bz_controller *c) {
+  return (c->chain);
+}
+
+void bz_killcontroller (bz_controller *c) {
+  if (c == NULL) return;
+  bz_killchain (c->chain);
+  free (c);
+}
+
+//
+//    Don't call these unless you absolutely have to.   bz__random_init
+//    also resets the seeds handed out to brains made after this call.
 int bz__random_init (unsigned int seed) {
   srandom (seed);
+  bz__seedbase = seed;
+  bz__seedcount = 0;
+  return (0);
 }
 
 float bz__random (float max) {
@@ -529,3 +4193,45 @@ float bz__random (float max) {
   //printf (" %f", r);
   return r;
 }
+
+//    The per-brain (or per-thread) generator: xoshiro128** by Blackman
+//    and Vigna.   Seeds are spread out with splitmix32 so that seeds
+//    1, 2, 3... give unrelated streams and a zero seed is still legal.
+static uint32_t bz__splitmix32 (uint32_t *x) {
+  uint32_t z;
+  z = (*x += 0x9e3779b9);
+  z = (z ^ (z >> 16)) * 0x85ebca6b;
+  z = (z ^ (z >> 13)) * 0xc2b2ae35;
+  return (z ^ (z >> 16));
+}
+
+void bz_rng_seed (bz_rng *rng, unsigned long seed) {
+  uint32_t x;
+  int i;
+  x = (uint32_t) seed ^ (uint32_t) (((uint64_t) seed) >> 32);
+  for (i = 0; i < 4; i++)
+    rng->s[i] = bz__splitmix32 (&x);
+}
+
+static inline uint32_t bz__rotl (uint32_t x, int k) {
+  return (x << k) | (x >> (32 - k));
+}
+
+uint32_t bz_rng_next (bz_rng *rng) {
+  uint32_t *s, result, t;
+  s = rng->s;
+  result = bz__rotl (s[1] * 5, 7) * 9;
+  t = s[1] << 9;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = bz__rotl (s[3], 11);
+  return (result);
+}
+
+//    Uniform float in [0, max) - top 24 bits, so every value is exact.
+float bz__rng_random (bz_rng *rng, float max) {
+  return max * ((bz_rng_next (rng) >> 8) * (1.0f / 16777216.0f));
+}
@@ -52,17 +52,25 @@
 //
 //   How about non-discrete (i.e. continuous) input state variables?  
 //
-//   How small can we make it?   DSPic-small?  Arduino-small?   
+//   How small can we make it?   DSPic-small?  Arduino-small?   (About 1.5K
+//   of code: bzembedded.h is the same learner in fixed point, with no
+//   malloc, stdio or libm, in storage the caller hands it.)
 //
 //   For large games, can we break down the situation (i.e. the state) into
 //   a bunch of chunks, each chunk to be treated identically and then the
-//   final action taken from the ensemble result?
+//   final action taken from the ensemble result?   (Yes, somewhat:
+//   BZ_BRAIN_FACTORED, below, keeps a little brain per chunk and pools
+//   their tokens when choosing.)
 //
 //   The berzerker API also allows multiple simultaneous copies of the
-//   algorithm to run simultaneously with different data (and with luck,
-//   someday it may even run reentrantly so multicore processing may be
-//   eventually possible someday.  But until we make sure it's
-//   reentrant, stick with one thread, OK?)
+//   algorithm to run simultaneously with different data.  Each brain
+//   has its own random stream, so separate brains on separate threads
+//   are fine, and bz_nextaction_r lets several threads sample the same
+//   brain with their own bz_rng.  But sampling writes too (a box that
+//   runs dry gets refilled right there), so using one brain from several
+//   threads at once - sampling or learning - is only safe after
+//   bz_sharebrain(), which puts striped locks on the rows
+//   (bz_trainparallel does the rest).
 //
 // THE BERZERKER API
 //
@@ -84,21 +92,26 @@
 //
 //              bz_blocks use a fixed-size array roughly the same size as the
 //              bz_brain structure.  Adding an action is constant time and
-//              very fast (just two array dereferences); learning and clearing
-//              require a scan of all cells which is proportional to the
-//              number of problem states * number of possible actions at
-//              each state.
+//              very fast (just two array dereferences, no malloc); learning
+//              and clearing only visit the cells that were actually used
+//              since the last clear (the block keeps a list of them), so
+//              their cost is proportional to the number of distinct
+//              state/action pairs touched, not the size of the brain.
 //
 //              bz_chains use a LIFO linked list, and start out as a very
-//              small fixed-size structure.  Adding an action is constant time
-//              but relatively slower than for blocks (there's a malloc()
-//              required) but learning is very fast (one array dereference)
-//              and clearing requires time proportional to the number of
-//              actions stored (and does a free() on each link).
+//              small fixed-size structure.  Links (and their masks) come
+//              from slabs the chain owns and recycles, so adding an action
+//              is constant time and only mallocs when the chain grows past
+//              anything it has held before; learning is very fast (one
+//              array dereference per link) and bz_zerochain clears the
+//              chain in constant time, keeping the links for reuse.
 //
 //            That said, the only thing that changes between blocks and chains
 //            is the speed/memory tradeoff.  The computed results should
-//            be identical (if they aren't, that's a bug!).
+//            be identical (if they aren't, that's a bug!) - with one
+//            exception: a block remembers only the last mask per state,
+//            so if the same state comes up with different masks, use a
+//            chain (see bz_newblock).
 // 
 //
 /////////////////////////////////////////////////////////////////////
@@ -106,6 +119,7 @@
 #include <stdio.h>
 #include <values.h>
 #include <string.h>
+#include <stdint.h>
 
 /////////////////////////////////////////////////////////////////////
 //
@@ -122,11 +136,29 @@
 /////////////////////////////////////////////////////////////////////////
 //
 #define BZ_BRAIN_QUANTIZED 0
+//    Same boxes, but only the states actually visited get storage; rows
+//    live in an open-addressed hash table keyed on the (64-bit) state.
+#define BZ_BRAIN_HASHED 1
+//    Dense like BZ_BRAIN_QUANTIZED, but each box is a 16-bit count
+//    scaled by one float per state - about half the memory (less for
+//    wide rows), for big brains and small machines.
+#define BZ_BRAIN_COMPACT 2
+//    An ensemble: the state is a mixed-radix number of several smaller
+//    sub-states (factors), each with its own little dense brain.   The
+//    tokens for an action are the sum over the factors' boxes, and every
+//    learn goes to each factor.   Memory is the sum of the factor sizes,
+//    not their product.   Made with bz_newbrain_factored.
+#define BZ_BRAIN_FACTORED 3
 
 ////////////////////////////////////////////////////////////////////////
 //
 ///     Magic constants
 #define TOKENMIN  (1000000*MINFLOAT)
+//      bz_newbrain_padded flags
+#define BZ_ALLOC_HUGEPAGES 1      //  big brains go on (transparent) huge pages
+#define BZ_ALLOC_PARALLELINIT 2   //  first-touch the rows from every CPU
+//      Brain file format version (bump if bz__filehead changes)
+#define BZ_FILE_VERSION 1
 
 
 /////////////////////////////////////////////////////////////////////////
@@ -142,14 +174,56 @@
 //} bz_state;
 
 
+//  Packed action masks: bit (i % 64) of word (i / 64) set means action i
+//  is allowed.   Brains with 64 or fewer actions need just one word.
+typedef uint64_t bz_maskword;
+#define BZ_MASKWORDS(actions) (((actions) + 63) / 64)
+
+//  Random number generator state.   Each brain carries one of these (so
+//  separate brains never share a stream), and callers that want several
+//  threads sampling from the same brain can each bring their own and
+//  call bz_nextaction_r.   This is xoshiro128** - small, fast, and
+//  good enough for choosing Michie tokens; NOT good enough for crypto.
+typedef struct my_bz_rng {
+  uint32_t s[4];
+} bz_rng;
+
+//  Running counts of what a brain has been doing, cheap enough to leave on
+//  all the time.   Get them with bz_getcounters, or a summary from
+//  bz_status (a shared brain keeps them per thread, so brain->counters
+//  alone is only the whole story for an unshared one).   underflows /
+//  decisions is the gambler's-ruin rate.
+typedef struct my_bz_counters {
+  uint64_t decisions;   //  actions chosen
+  uint64_t underflows;  //  boxes found empty and refilled while choosing
+  uint64_t learns;      //  state/action boxes learned
+  uint64_t clamps;      //  learns that drove a box down to TOKENMIN
+  uint64_t chains;      //  chains learned ...
+  uint64_t chainlinks;  //  ... and their total length
+  uint64_t maxchain;    //  longest chain learned
+} bz_counters;
+
 //  brains have states which are actually dense packed arrays.
 //  So, the offset within *state is [state * maxstates + actionnum]
 typedef struct my_bz_brain {
-  int braintype;        //  0 = discrete,  >0 = ???
+  int braintype;        //  BZ_BRAIN_QUANTIZED, BZ_BRAIN_HASHED, ...
   int maxstates;
   int maxactions;
   int starting_tokens;
+  int rowstride;  //  floats from one state's row to the next (>= maxactions)
   float *states;  //  because C has only 1D arrays, we collapse this densely
+  struct bz__hash *hash;    //  row table for BZ_BRAIN_HASHED (states NULL)
+  uint16_t *qstates;  //  BZ_BRAIN_COMPACT boxes (states NULL) ...
+  float *scales;      //  ... and the per-state scale that goes with them
+  void *mapbase;  //  non-NULL if this brain lives in an mmap'd file
+  long maplen;
+  bz_rng rng;     //  this brain's own random stream (see bz_seedbrain)
+  struct bz__locks *locks;  //  striped row locks, NULL unless shared
+  struct bz__countslot *countslots;  //  per-thread counters, if shared
+  struct bz__infer *infer;  //  cached per-state CDFs, NULL unless enabled
+  struct bz__factors *factors;  //  BZ_BRAIN_FACTORED sub-brains (states NULL)
+  struct bz__tracker *trackers; //  dirty-row bitmaps (bz_sync ...), or NULL
+  bz_counters counters;
 } bz_brain;
 
 //   Chain element for learning chains - much faster!  Like ten thousand
@@ -157,16 +231,135 @@ typedef struct my_bz_brain {
 typedef struct bz__chel { // INTERNAL USE ONLY...chain element --> chel.
   long state;
   long action;
-  char *mask;
+  char *mask;      //  NULL, or maskbuf if this link was given a mask
+  char *maskbuf;   //  maxactions bytes, right behind the link in its slab
   struct bz__chel *next; 
 } bz__chel;
 
 typedef struct my_bz_chain {
   bz_brain *brain;
-  bz__chel *chels;
-  long totalcount;
+  bz__chel *chels;      //  newest first
+  bz__chel *tail;       //  oldest link, so clearing is one splice
+  bz__chel *freechels;  //  recycled links waiting for reuse
+  struct bz__slab *slabs;   //  the memory all the links live in
+  long slabsize;        //  links in the next slab we allocate
+  long totalcount;      //  links currently on the chain
+  char *ring;           //  ring chains only: ringsize links, back to back
+  long ringsize;        //  0 for an ordinary (growable) chain
+  long ringhead;        //  ring slot holding the newest link
 } bz_chain;
 
+//   Block-style learning memory: one use-count per brain cell, plus the
+//   list of cells that have a nonzero count so we never have to scan
+//   the whole thing.
+typedef struct my_bz_block {
+  bz_brain *brain;
+  int *counts;     //  times each state/action was used, same shape as brain
+  char *masks;     //  the LAST mask given for each state (maxactions each)
+  char *hasmask;   //  per state: 1 if masks[] holds a mask for it
+  long *dirty;     //  cells with nonzero counts, in order of first use
+  long ndirty;
+  long dirtysize;  //  allocated length of dirty[] (grows, never shrinks)
+  long totalcount;
+} bz_block;
+
+//   State canonicalization.   Many problems have symmetries (tic-tac-toe
+//   boards can be rotated and flipped 8 ways) under which states that
+//   look different are really the same position.   A bz_canon maps each
+//   raw state to one compact canonical state, and remembers which
+//   symmetry got it there so actions can be carried across too; a brain
+//   of canon->ncanon states then learns once for all the look-alikes.
+typedef struct my_bz_canon {
+  long nstates;    //  raw states, 0 .. nstates-1
+  int nactions;
+  int nsyms;       //  symmetries, including the identity
+  long ncanon;     //  distinct canonical states (size the brain to this)
+  long *canon;     //  raw state -> canonical state
+  unsigned char *sym;  //  raw state -> the symmetry that canonicalizes it
+  int *perm;       //  [sym][raw action] -> action in the canonical frame
+  int *inv;        //  [sym][canonical action] -> raw action
+} bz_canon;
+
+//   A greedy policy: the best action of every state, packed a nibble or
+//   a byte per state (see bz_newpolicy).
+typedef struct my_bz_policy {
+  long nstates;
+  int nactions;
+  int bits;               //  4 (up to 15 actions) or 8 (up to 255)
+  int none;               //  the entry for a state with nothing legal
+  unsigned char *table;   //  two states a byte (low nibble first), or one
+  long bytes;             //  size of table
+} bz_policy;
+
+//   An asynchronous learner (see bz_newlearner); what's inside is private.
+typedef struct bz__learner bz_learner;
+
+//   Episode logs, for keeping experience (see bz_openlog); private inside.
+typedef struct bz__logwriter bz_logwriter;
+typedef struct bz__logreader bz_logreader;
+
+//   A replica's view of what it and the others have learned (see
+//   bz_newsync); private inside.
+typedef struct bz__sync bz_sync;
+
+//   A background checkpoint writer (see bz_newcheckpointer); private.
+typedef struct bz__checkpointer bz_checkpointer;
+
+//   A training monitor (see bz_newmonitor); private inside.   What it
+//   found at its last check comes out as a bz_monstats.
+typedef struct bz__monitor bz_monitor;
+#define BZ_MONMAXOUTCOMES 16
+#define BZ_MONMAXBRAINS 8
+typedef struct my_bz_monstats {
+  long episodes;          //  outcomes recorded so far
+  long window;            //  how many of the latest the rates are over
+  int noutcomes;
+  double rate[BZ_MONMAXOUTCOMES];  //  fraction of the window per outcome
+  double underflowrate;   //  underflows / decisions since the check before
+  double entropy;         //  mean over learned rows: 1 undecided, 0 certain
+  long rows;              //  how many learned rows that was
+} bz_monstats;
+
+//   A stop test gets the latest stats; nonzero means "that'll do".
+typedef int (*bz_stop_fn) (const bz_monstats *stats, void *userdata);
+
+//   The stop test most people want (bz_stoprate, with one of these as
+//   its userdata): a big enough window with at least minrate of
+//   "outcome", and no more than maxunderflow underflows per decision.
+typedef struct my_bz_stoprule {
+  int outcome;
+  double minrate;
+  double maxunderflow;
+  long minwindow;
+} bz_stoprule;
+
+//   Real-time control (see bz_newcontroller) and its binary telemetry
+//   (bz_newtelemetry); both private inside.
+typedef struct bz__controller bz_controller;
+typedef struct bz__telemetry bz_telemetry;
+
+//   One telemetry record, as it lands in the file: a step's state,
+//   action and reward, when it happened and how long it took (both in
+//   nanoseconds; "nanos" is since the controller was made), and up to
+//   BZ_TELMAXVALUES of the caller's own numbers.   The file is the 8
+//   bytes of BZ_TELMAGIC, an int32 sizeof (bz_telrecord), then the
+//   records back to back, in this machine's byte order.
+#define BZ_TELMAXVALUES 8
+#define BZ_TELMAGIC "BZTELEM1"
+typedef struct my_bz_telrecord {
+  uint64_t step;
+  int64_t nanos;
+  int64_t state;
+  int32_t action;
+  float reward;
+  int32_t latency;
+  int32_t nvalues;
+  float values[BZ_TELMAXVALUES];
+} bz_telrecord;
+
+//   Apply symmetry "sym" to a raw state, giving another raw state.
+typedef long (*bz_symmetry_fn) (void *userdata, long state, int sym);
+
 ////////////////////////////////////////////////////////////////////////
 //
 //      The function definitions
@@ -179,35 +372,181 @@ void bz_init ();
 //     get the version (remember to free() the result)
 char *bz_version ();
 
-//     get status?   What does this do?
-char *bz_status ();
+//     get a one-line summary of a brain's counters (free() the result)
+char *bz_status (bz_brain *brain);
 
-//     Create a new brain.
+//     a brain's counters, added up across threads if it's shared
+void bz_getcounters (bz_brain *brain, bz_counters *counters);
+
+//     zero a brain's counters
+void bz_resetcounters (bz_brain *brain);
+
+//     Create a new brain.   For BZ_BRAIN_HASHED, max_states is only a
+//     hint of how many states you expect to actually visit (0 is fine);
+//     any state number at all is legal and rows appear, full of
+//     tokens_per_node tokens, the first time a state is used.
 bz_brain *bz_newbrain (
-		       int braintype,   //  0 => discrete brain.  >0 => ????
+		       int braintype,   //  0 discrete, 1 hashed, 2 compact
 		       int max_states,
 		       int max_actions,
 		       int tokens_per_node);
 
+//     A dense (BZ_BRAIN_QUANTIZED) brain whose rows are padded so none
+//     straddles a cache line (3 actions take 4 floats, 9 take 16) and
+//     start 64-byte aligned; flags are BZ_ALLOC_*.   Costs memory,
+//     saves cache and TLB misses on big, randomly visited brains.
+//     Saved and loaded (or mapped) brains keep their padding.
+bz_brain *bz_newbrain_padded (int max_states, int max_actions,
+			      int tokens_per_node, int flags);
+
+//     A BZ_BRAIN_FACTORED brain over nfactors sub-states, factor i having
+//     factor_states[i] values.   A state is then
+//
+//         s[0] + factor_states[0] * (s[1] + factor_states[1] * (s[2] ...
+//
+//     (bz_factorstate builds one), and every other call takes it like
+//     any other state.   Each factor box starts with tokens_per_node
+//     tokens.   Factored brains can be shared and learned into
+//     asynchronously, but can't (yet) be saved, blocked or cached.
+bz_brain *bz_newbrain_factored (int nfactors, const long *factor_states,
+				int max_actions, int tokens_per_node);
+long bz_factorstate (bz_brain *brain, const long *substates);
+
+//     How many state rows this brain is actually holding.
+long bz_brainrows (bz_brain *brain);
+
+//     Save a brain to a file, and get it back.   The file is versioned
+//     and checked on the way in (NULL if it isn't a brain we can read).
+//     bz_loadbrain reads a private copy; bz_mapbrain maps the file
+//     instead, so startup is instant and processes mapping the same
+//     file share one copy of the tokens in the page cache.   A mapped
+//     brain can still learn (copy-on-write), but that never touches the
+//     file.   bz_killbrain works on all of them.   Save returns 0 on
+//     success.
+int bz_savebrain (bz_brain *brain, const char *filename);
+bz_brain *bz_loadbrain (const char *filename);
+bz_brain *bz_mapbrain (const char *filename);
+
+//     Reseed a brain's private random stream.   Same seed, same brain
+//     parameters, same calls => same actions, every time.
+void bz_seedbrain (bz_brain *brain, unsigned long seed);
+
 //     Delete a brain back to free memory.
 int bz_killbrain (bz_brain *brain);
 
+//     Make a brain safe to use from several threads at once.  Each state
+//     row is guarded by one of "stripes" mutexes (state % stripes), and
+//     bz_nextaction_r / bz_learnstateaction / bz_learnchain take it.
+//     Each thread still needs its own bz_rng and its own chains.
+//     Returns 0 on success.
+int bz_sharebrain (bz_brain *brain, int stripes);
+
 //     chain-style learning memory.
 bz_chain *bz_newchain (bz_brain *brain);
 
 //     Given a brain, and a state, and a set of allowed actions, what's
-//     this brain choose to do.  (DEPENDS ON RAND() !!!)
+//     this brain choose to do.  (DEPENDS ON THE BRAIN'S RNG !!!)
 long bz_nextaction (
 		     bz_brain *brain,
-		     int cur_state,
+		     long cur_state,
 		     float *evse,       // research vs. exploit control
 		     char mask[],       // the set of allowed actions
 		     int *underflows    // optional underflows (incremented)
 		     );
 
+//     Same as bz_nextaction, but draws its random numbers from the
+//     caller's rng rather than the brain's own.   This is the reentrant
+//     version - give each thread its own bz_rng.
+long bz_nextaction_r (
+		       bz_brain *brain,
+		       bz_rng *rng,
+		       long cur_state,
+		       float *evse,
+		       char mask[],
+		       int *underflows
+		       );
+
+//     Same again, with the allowed actions as a packed bitmask (see
+//     bz_maskword); only the set bits are visited, so this is the one
+//     to use for wide action spaces.  NULL legalbits allows everything,
+//     NULL rng uses the brain's own.
+long bz_nextaction_bits (
+			  bz_brain *brain,
+			  bz_rng *rng,
+			  long cur_state,
+			  float *evse,
+			  const bz_maskword *legalbits,
+			  int *underflows
+			  );
+
+//     Batch version for lockstep environments: actions[i] is picked for
+//     states[i], with legalbits[i * maskstride ...] as its mask (stride 0
+//     = one mask for all, NULL legalbits = all legal).  Same picks as n
+//     calls to bz_nextaction_bits, minus the per-call overhead.
+int bz_nextaction_many (
+			bz_brain *brain,
+			bz_rng *rng,
+			int n,
+			const long *states,
+			float *evse,
+			const bz_maskword *legalbits,
+			int maskstride,
+			long *actions,
+			int *underflows
+			);
+
+//     Inference mode, for deployed (mostly read-only) brains.  After
+//     bz_inferencemode, bz_nextaction_cached samples from a cumulative
+//     table kept per state (built with the given evse, NULL = 1.0) by
+//     binary search, instead of rescanning and reweighting the row.
+//     A state's table is built the first time it's asked for and
+//     rebuilt only after bz_learnstateaction (or a refill) touches that
+//     state, or when it's asked with a different legal-action mask.
+//     The cached path never writes tokens: a dry box just acts as if
+//     it were full.   Returns 0 on success.
+int bz_inferencemode (bz_brain *brain, float *evse);
+long bz_nextaction_cached (
+			    bz_brain *brain,
+			    bz_rng *rng,      // NULL = the brain's own
+			    long cur_state,
+			    const bz_maskword *legalbits  // NULL = all legal
+			    );
+
+//     Greedy policies, for when a deployed brain only ever exploits.
+//     bz_newpolicy takes every state's highest-token legal action (ties
+//     go to the lowest) and packs them into a table; legal() is asked
+//     for each state's legal actions (set their bits, all else is 0 on
+//     the way in; return 0 for a state that never comes up), or NULL
+//     allows them all.   bz_policyaction is then one table lookup - no
+//     rng, no row scan, no locks - giving -1 for states with nothing
+//     legal.   A 9-action brain goes from 36 bytes of floats per state
+//     to half a byte.   It's a snapshot: learn more, export again.
+//     Hashed brains have no state table to export (NULL).
+typedef int (*bz_legal_fn) (void *userdata, long state,
+			    bz_maskword *legalbits);
+bz_policy *bz_newpolicy (bz_brain *brain, bz_legal_fn legal, void *userdata);
+long bz_policyaction (const bz_policy *policy, long state);
+void bz_killpolicy (bz_policy *policy);
+
+//     Convert a char mask (>=0 allowed, same as bz_nextaction) into
+//     BZ_MASKWORDS(maxactions) words of bits.
+void bz_maskbits (bz_brain *brain, char *mask, bz_maskword *bits);
+
+//     Random number streams.   bz_rng_seed expands any seed (including
+//     zero) into a valid generator state.
+void bz_rng_seed (bz_rng *rng, unsigned long seed);
+uint32_t bz_rng_next (bz_rng *rng);
+
 bz_chain *bz_newchain (bz_brain *brain);
+//     A chain that never holds more than "capacity" links: adding to a
+//     full one overwrites its oldest link in constant time, with no
+//     malloc or free per step.   The same as bz_addtochain followed by
+//     bz_truncatechain (chain, capacity - 1), only cheaper.
+bz_chain *bz_newringchain (bz_brain *brain, long capacity);
 
 void bz_addtochain (bz_chain *chain, long state, long action, char *mask);
+void bz_addtochain_bits (bz_chain *chain, long state, long action,
+			 const bz_maskword *legalbits);
 int bz_truncatechain (bz_chain *chain, long count);
 void bz_learnchain (bz_brain *brain,
 		   bz_chain *chain,
@@ -217,6 +556,218 @@ void bz_learnchain (bz_brain *brain,
 void bz_zerochain (bz_chain *chain);
 void bz_killchain (bz_chain *chain);
 
-//    Internal use only.  Do not depend on this function
+//     block-style learning memory.   No malloc per action.   Clear it
+//     with bz_zeroblock and reuse it.   A block keeps one mask per
+//     state, so a state added twice with different masks learns both
+//     times with the last one (a chain keeps each); that only matters
+//     when a box runs dry, but use a chain if your masks change.
+bz_block *bz_newblock (bz_brain *brain);
+void bz_addtoblock (bz_block *block, long state, long action, char *mask);
+void bz_learnblock (bz_brain *brain,
+		    bz_block *block,
+		    float add,
+		    float multiply,
+		    int *on_empty);
+void bz_zeroblock (bz_block *block);
+void bz_killblock (bz_block *block);
+
+//     Learn one state/action directly (this is what bz_learnchain does
+//     for each link of the chain).
+int bz_learnstateaction (bz_brain *brain, long state, int action, char *mask,
+			 float add, float multiply, int *on_empty);
+int bz_learnstateaction_bits (bz_brain *brain, long state, int action,
+			      const bz_maskword *legalbits,
+			      float add, float multiply, int *on_empty);
+
+//     Parallel training.   Runs "episodes" calls of episode() spread
+//     across "nthreads" worker threads (nthreads <= 1 runs them right
+//     here in the calling thread).   Each worker gets its own bz_rng,
+//     seeded from "seed" plus the worker number; episode() gets that
+//     rng, the worker number, and which episode this is.   Any brain
+//     that more than one worker touches must have been through
+//     bz_sharebrain first.   If episode() returns nonzero, no more
+//     episodes are started (ones already under way finish), so it can
+//     stop training early.   Returns the number of episodes run.
+typedef int (*bz_episode_fn) (void *userdata, int worker, bz_rng *rng,
+			      long episode);
+long bz_trainparallel (int nthreads,
+		       long episodes,
+		       unsigned long seed,
+		       bz_episode_fn episode,
+		       void *userdata);
+
+//     Training monitors.   Tell a monitor how each episode came out (an
+//     outcome from 0 to noutcomes-1 - say draw, P1 won, P2 won) from
+//     whatever thread played it, and give it the brains to watch.
+//     Every "every" outcomes it works out the rates over the last
+//     "window" of them, the watched brains' underflow rate since the
+//     check before, and their mean row entropy, and asks stop().   Once
+//     stop() says yes, bz_monitorrecord returns nonzero from then on -
+//     return that from your bz_trainparallel episode and training ends
+//     early.   A check looks at every row, so make "every" a good few
+//     episodes.   stop may be NULL (just watching).
+//
+//     bz_monitorcheck checks right now (and fills in stats, if not NULL);
+//     bz_monitorstats gives the last check's numbers; bz_monitorstopped
+//     is how many outcomes had been recorded when stop() said yes (0 if
+//     it hasn't).   Entropy counts every box of a row, masked or not,
+//     so compare it with itself over time rather than with 0.
+bz_monitor *bz_newmonitor (int noutcomes, long window, long every,
+			   bz_stop_fn stop, void *userdata);
+int bz_monitorbrain (bz_monitor *mon, bz_brain *brain);
+int bz_monitorrecord (bz_monitor *mon, int outcome);
+int bz_monitorcheck (bz_monitor *mon, bz_monstats *stats);
+void bz_monitorstats (bz_monitor *mon, bz_monstats *stats);
+long bz_monitorstopped (bz_monitor *mon);
+void bz_killmonitor (bz_monitor *mon);
+int bz_stoprate (const bz_monstats *stats, void *rule);
+
+//     Canonicalization.   perms holds nsyms rows of nactions: perms[s *
+//     nactions + a] is where action a lands when the state is moved by
+//     symmetry s, which apply() does.   Symmetry 0 must be the identity,
+//     and the symmetries must form a group (closed, with inverses).
+//     The canonical representative is the smallest raw state among a
+//     state's images; they are then numbered densely from 0.
+bz_canon *bz_newcanon (long nstates, int nactions, int nsyms,
+		       const int *perms, bz_symmetry_fn apply,
+		       void *userdata);
+void bz_killcanon (bz_canon *canon);
+//     Canonical state for a raw one (and the symmetry used, if sym isn't
+//     NULL; -1 if the state is out of range), and a raw mask carried
+//     over to the canonical frame.
+long bz_canonstate (bz_canon *canon, long state, int *sym);
+void bz_canonmask (bz_canon *canon, int sym, const bz_maskword *rawbits,
+		   bz_maskword *canonbits);
+//     bz_nextaction_bits and bz_addtochain_bits, but taking raw states,
+//     actions and masks; the brain and chain only ever see canonical
+//     ones.   The action returned is a raw one (-1 for a bad state).
+long bz_nextaction_canon (bz_brain *brain, bz_canon *canon, bz_rng *rng,
+			  long state, float *evse,
+			  const bz_maskword *legalbits, int *underflows);
+void bz_addtochain_canon (bz_chain *chain, bz_canon *canon, long state,
+			  long action, const bz_maskword *legalbits);
+
+//     Asynchronous learning.   A learner owns a thread that applies
+//     queued updates to one brain, so actors can hand off a finished
+//     chain and get straight on with the next episode.   Pushing never
+//     takes a lock (it only waits if the queue, "capacity" updates long,
+//     is full).   The learner sorts each batch by state, so a row is
+//     touched once per batch rather than once per game.   The brain is
+//     bz_sharebrain'd for you; hashed brains can't have a learner.
+//     Updates land a little later than bz_learnchain's would, and in a
+//     different order; bz_learnerflush waits for all of them.
+bz_learner *bz_newlearner (bz_brain *brain, long capacity);
+void bz_learnchain_async (bz_learner *learner, bz_chain *chain,
+			  float add, float multiply);
+void bz_learnstateaction_async (bz_learner *learner, long state, int action,
+				const bz_maskword *legalbits,
+				float add, float multiply);
+void bz_learnerflush (bz_learner *learner);
+void bz_killlearner (bz_learner *learner);
+
+//     Episode logs.   An append-only binary file of steps (state,
+//     action, mask) and episode ends (the reward), so experience from a
+//     real rig can be replayed into brains later.   Writes are buffered;
+//     nothing's certain to be on disk until bz_closelog.   Steps go in
+//     the order they should be learned, like a chain (bz_logchain does
+//     a whole chain and its reward at once).   Reopening a log that was
+//     cut off mid-episode trims it back to its last whole episode.
+bz_logwriter *bz_openlog (const char *filename, int maxactions);
+int bz_logstep (bz_logwriter *log, long state, int action,
+		const bz_maskword *legalbits);
+int bz_logend (bz_logwriter *log, float add, float multiply);
+int bz_logchain (bz_logwriter *log, bz_chain *chain, float add,
+		 float multiply);
+int bz_closelog (bz_logwriter *log);
+//     Reading back, through mmap: episode by episode into a chain, or
+//     the whole log straight into a brain (same result as learning each
+//     episode's chain, returns the steps learned or -1).   Episodes
+//     whose states or actions don't fit the brain are skipped.
+bz_logreader *bz_openreplay (const char *filename);
+int bz_replayepisode (bz_logreader *reader, bz_chain *chain,
+		      float *add, float *multiply);
+void bz_closereplay (bz_logreader *reader);
+long bz_replaylog (bz_brain *brain, const char *filename, long *episodes);
+
+//     Distributed training.   Each process (or host) trains its own
+//     replica of a dense brain, all started the same, with a bz_sync on
+//     it.   Every so often each one bz_deltaencode's the rows it has
+//     changed since its last encode (a malloc'd buffer, 16 bits a box,
+//     only touched rows - free it yourself; returns its length or -1),
+//     ships it to the others however it likes, and bz_deltamerge's
+//     theirs in, each scaled by "weight" (returns rows merged, or -1 if
+//     it's not a delta for this brain):
+//
+//       summing:    merge each other replica's delta with weight 1.0
+//       averaging:  with N replicas, merge the others' with 1.0/N and
+//                   your own with 1.0/N - 1.0 (it's already learned)
+//
+//     Actors can keep learning right through both, if the brain is
+//     shared.   Make the bz_sync before training starts, and kill it
+//     before the brain.
+bz_sync *bz_newsync (bz_brain *brain);
+long bz_deltaencode (bz_sync *sync, void **delta);
+long bz_deltamerge (bz_sync *sync, const void *delta, long len, float weight);
+void bz_killsync (bz_sync *sync);
+
+//     Checkpoints of a brain that's still training.   bz_newcheckpointer
+//     saves the (dense) brain to "filename" once - so make it while
+//     nobody is learning - then a thread of its own appends just the
+//     rows changed since to "filename.bzpatch" every "seconds", and
+//     every so often folds those back into "filename".   The actors
+//     never wait on it for more than one row's copy, and it shares the
+//     brain for you.   bz_checkpointnow does a round right away;
+//     bz_killcheckpointer does a last one and stops (nonzero if any
+//     writes failed).   After a crash, bz_loadcheckpoint gets back the
+//     brain as of the last finished round.
+bz_checkpointer *bz_newcheckpointer (bz_brain *brain, const char *filename,
+				     double seconds);
+int bz_checkpointnow (bz_checkpointer *cp);
+int bz_killcheckpointer (bz_checkpointer *cp);
+bz_brain *bz_loadcheckpoint (const char *filename);
+
+//     Real-time control.   A bz_controller runs a brain one step at a
+//     time - observe, learn, act - with nothing on the way that can
+//     block: no malloc, no I/O, no waiting on another thread.
+//     bz_step takes the state just seen and the reward for how it's
+//     going; once the last "memory" steps are all in, it learns them
+//     with that reward (tokens = reward + multiply * tokens), then
+//     picks, remembers, and returns this step's action.   evse NULL is
+//     flat.   bz_waitstep sleeps until "period" seconds after the last
+//     deadline, so a loop of bz_step and bz_waitstep keeps a steady beat
+//     whatever each step cost; it returns how many deadlines have been
+//     missed so far (after a miss it starts the beat again from now).
+//     bz_steptaken is bz_step for when something else already chose
+//     this step's action (an operator, a safety override, a fixed
+//     command): the brain doesn't pick, and "action" is what gets
+//     learned and logged, so it's only ever taught what the plant saw.
+//
+//     Give bz_newcontroller a bz_telemetry and every step also pushes a
+//     record (with "values", up to BZ_TELMAXVALUES of them, for the rest
+//     of your state) into a lock-free ring; a thread of its own writes
+//     them to "filename".   If the ring is full the record is dropped
+//     rather than keep anyone waiting - bz_telemetrypush says 1 - and
+//     bz_killtelemetry, which writes out the rest and closes the file,
+//     returns how many were (or -1 if writing failed).   Several
+//     controllers (or anyone else) can push to one telemetry.
+bz_telemetry *bz_newtelemetry (const char *filename, long capacity);
+int bz_telemetrypush (bz_telemetry *tel, const bz_telrecord *rec);
+long bz_killtelemetry (bz_telemetry *tel);
+bz_controller *bz_newcontroller (bz_brain *brain, int memory, float *evse,
+				 float multiply, bz_telemetry *tel);
+long bz_step (bz_controller *c, long state, float reward,
+	      const bz_maskword *legalbits, const float *values, int nvalues);
+long bz_steptaken (bz_controller *c, long state, float reward, long action,
+		   const bz_maskword *legalbits, const float *values,
+		   int nvalues);
+long bz_waitstep (bz_controller *c, double period);
+long bz_controllersteps (bz_controller *c);
+//     the chain of the last "memory" steps (look, but don't touch)
+bz_chain *bz_controllerchain (bz_controller *c);
+void bz_killcontroller (bz_controller *c);
+
+//    Internal use only.  Do not depend on these functions
 //    being stable!  (note the double-underscore)
 float bz__random (float max);
+float bz__rng_random (bz_rng *rng, float max);
+int bz__random_init (unsigned int seed);
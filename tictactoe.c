@@ -23,10 +23,35 @@
 //   and generate it at runtime rather than enumerating it for all 19K
 //   possible board states.
 //
+//  Run with no arguments, it does one long run with the #defines below.
+//  Any arguments make it a sweep instead: give any of the knobs a list,
+//  e.g.
+//
+//     tictactoe --evse 2,5,9 --draw-add 0.1,0.5 --repeats 100000 --batch 10000 --jobs 8
+//
+//  and each combination gets its own pair of brains, 8 pairs at a time,
+//  with one P50 / P90 line per combination at the end.   Add
+//  "--stop-draws 0.9" and each one stops as soon as 90% of a batch's
+//  games are draws (the "played" column says when).   "--shard 2/4"
+//  runs just every fourth combination starting at the third, so four
+//  hosts can split the grid between them.   Or, to throw four processes
+//  (or hosts, with a shared directory) at the same combinations:
+//
+//     tictactoe ... --replica 0/4 --syncdir /shared/tmp --syncevery 10000
+//     tictactoe ... --replica 1/4 --syncdir /shared/tmp --syncevery 10000
+//     ...
+//
+//  and every 10000 double-games they swap the rows they've changed and
+//  average their brains.   The files are named by --seed, and the last
+//  two rounds' are left in the directory afterwards, so run again with
+//  another --seed (or empty the directory first).
 //
 #include "bzerker.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
 //    Parameters that define the generalized form
 //    of tic-tac-toe.
 #define STATES 19683
@@ -440,255 +465,941 @@
 
 
 
+//   (the setups that don't say otherwise are BOXES Classic)
+#ifndef EVSE
+#define FLAT_EVSE 1
+#define EVSE 1.00
+#endif
+
 #define MAX_TURNS 10
 #define PRINT_EACHGAME 0
 
+//    How many worker threads play games at once.  With more than one,
+//    both brains are shared (striped locks) and each worker plays whole
+//    double-games on its own board and chains.
+#define THREADS 1
+
+//    Rotated and flipped boards are the same game.   With SYMMETRY the
+//    brains only ever see one canonical board out of each set of (up to)
+//    8 look-alikes, so they learn from all of them at once and need
+//    about 1/7 the rows.   Without it, every board is learned alone.
+#define SYMMETRY
+
+//    With ASYNC_LEARN, finished games are queued for a learner thread
+//    per brain instead of being learned before the next game starts.
+//#define ASYNC_LEARN
+
+//    With CHECKPOINT, the long run keeps each brain checkpointed (every
+//    CHECKPOINT_SECS, without stopping play) in CHECKPOINT.1 and .2;
+//    bz_loadcheckpoint gets them back.
+//#define CHECKPOINT "tictactoe.ckpt"
+#define CHECKPOINT_SECS 10
+
+//    BZ_BRAIN_QUANTIZED allocates a row for every one of the 3^9 boards;
+//    BZ_BRAIN_HASHED only makes rows for boards that actually come up
+//    (hashed brains can't be shared, so use it with THREADS 1).
+#define BRAINTYPE BZ_BRAIN_QUANTIZED
+
+//    With STOP_DRAWS above 0, a run stops as soon as that fraction of
+//    the last batch's games were draws - the forced-draw regime - with
+//    no more than STOP_UNDERFLOWS of the moves since the last look
+//    running a box dry, instead of playing all REPEATS.   (Not with
+//    replicas: they'd wait forever for the one that stopped.)
+#define STOP_DRAWS 0
+#define STOP_UNDERFLOWS 1.0
+
+//   One training run: the knobs (from the #defines above, or from the
+//   command line when sweeping), the two brains, and how it went.
+typedef struct my_ttt_run {
+  long tokens, repeats, batchsize;
+  int flat_evse;          //  1 to pass a NULL evse ("BOXES Classic")
+  float evse;
+  float win_add, win_mul, lose_add, lose_mul, draw_add, draw_mul;
+  int threads;
+  unsigned long seed;
+  //   replicated training (see ttt_sync); nreplicas 1 means just us
+  int replica, nreplicas;
+  long syncevery;
+  char *syncdir;
+  unsigned long runid;    //  the seed all the replicas were given
+  long point;             //  which grid point, so sweeps don't collide
+  long first;             //  episode number of this stretch's first game
+  double stop_draws, stop_underflows;   //  see STOP_DRAWS
+  bz_monitor *monitor;    //  NULL unless we might stop early
+  bz_stoprule rule;       //  what the monitor stops on
+  long played;            //  double-games actually played
+  bz_brain *brain1, *brain2;   // our two competing brains
+  bz_learner *learner1, *learner2;   // NULL without ASYNC_LEARN
+  //   each worker's pair of chains, made once and zeroed between games
+  bz_chain **chains1, **chains2;
+  //   per-batch results; bumped atomically because workers share them
+  int *log_0, *log_1, *log_2, *log_gr;
+  long p50, p90, ctpp;    //  filled in by ttt_score
+} ttt_run;
+
 //   A few globals:
-bz_brain *brain1, *brain2;   // our two competing brains
-bz_chain *chain1, *chain2;
-int gb[9]; // the game board
-int *gamblers_ruins;
+bz_canon *ttt_canon;         // board symmetries, NULL without SYMMETRY
+long *ttt_reps;              // canonical state -> its own raw board
 //   Some function definitions.
-int play_ttt( bz_brain *b1, bz_chain *s1,
+int play_ttt( ttt_run *run,
+	      bz_brain *b1, bz_chain *s1,
 	      bz_brain *b2, bz_chain *s2,
-	      int *gamblers_ruin);
+	      bz_rng *rng, int *gamblers_ruin);
+
+typedef struct my_ttt_board ttt_board;   //  the board, further down
+int execute_move (ttt_board *b, int square, int value);
+void init_ttt_tables ();
+bz_canon *make_ttt_canon ();
+int ttt_greedygame (bz_policy *first, bz_policy *second);
+int ttt_legal (void *userdata, long state, bz_maskword *legalbits);
+
+//   One training episode: a double-game, each brain going first once.
+int ttt_episode (void *userdata, int worker, bz_rng *rng, long reps) {
+  int action, batch, ruins, stop;
+  ttt_run *run;
+  bz_chain *chain1, *chain2;
+  run = (ttt_run *) userdata;
+  reps += run->first;
+  batch = reps/run->batchsize;
+  ruins = 0;
+  stop = 0;
+  chain1 = run->chains1[worker];
+  chain2 = run->chains2[worker];
+  //printf (" Starting game %d \n", reps);
+  bz_zerochain (chain1);
+  bz_zerochain (chain2);
+  action = play_ttt (run, run->brain1, chain1, run->brain2, chain2, rng, &ruins);
+  if (action == 0) { __atomic_fetch_add (&run->log_0[batch], 1, __ATOMIC_RELAXED); };
+  if (action == 1) { __atomic_fetch_add (&run->log_1[batch], 1, __ATOMIC_RELAXED); };
+  if (action == 2) { __atomic_fetch_add (&run->log_2[batch], 1, __ATOMIC_RELAXED); };
+  if (run->monitor) stop |= bz_monitorrecord (run->monitor, action);
+  bz_zerochain (chain1);
+  bz_zerochain (chain2);
+  action = play_ttt (run, run->brain2, chain2, run->brain1, chain1, rng, &ruins);
+  if (action == 0) { __atomic_fetch_add (&run->log_0[batch], 1, __ATOMIC_RELAXED); };
+  if (action == 1) { __atomic_fetch_add (&run->log_1[batch], 1, __ATOMIC_RELAXED); };
+  if (action == 2) { __atomic_fetch_add (&run->log_2[batch], 1, __ATOMIC_RELAXED); };
+  if (run->monitor) stop |= bz_monitorrecord (run->monitor, action);
+  if (ruins) __atomic_fetch_add (&run->log_gr[batch], ruins, __ATOMIC_RELAXED);
+  return (stop);
+}
+
+//   The knobs as the #defines set them.
+void ttt_defaults (ttt_run *run) {
+  run->tokens = TOKENS;
+  run->repeats = REPEATS;
+  run->batchsize = BATCHSIZE;
+#ifdef FLAT_EVSE
+  run->flat_evse = 1;
+#else
+  run->flat_evse = 0;
+#endif
+  run->evse = EVSE;
+  run->win_add = WIN_ADD;    run->win_mul = WIN_MUL;
+  run->lose_add = LOSE_ADD;  run->lose_mul = LOSE_MUL;
+  run->draw_add = DRAW_ADD;  run->draw_mul = DRAW_MUL;
+  run->threads = THREADS;
+  run->seed = 1;
+  run->replica = 0;
+  run->nreplicas = 1;
+  run->syncevery = 10000;
+  run->syncdir = ".";
+  run->runid = 1;
+  run->point = 0;
+  run->first = 0;
+  run->stop_draws = STOP_DRAWS;
+  run->stop_underflows = STOP_UNDERFLOWS;
+  run->monitor = NULL;
+}
+
+//   Make the brains, chains and per-batch logs for a run.
+void ttt_newrun (ttt_run *run) {
+  long nstates, nbatch, i;
+  nstates = ttt_canon ? ttt_canon->ncanon : STATES;
+  run->brain1 = bz_newbrain (BRAINTYPE, nstates, ACTIONS, run->tokens);
+  run->brain2 = bz_newbrain (BRAINTYPE, nstates, ACTIONS, run->tokens);
+  if (run->threads > 1) {
+    bz_sharebrain (run->brain1, 1024);
+    bz_sharebrain (run->brain2, 1024);
+  }
+  nbatch = run->repeats / run->batchsize + 1;
+  run->log_0 = calloc (nbatch, sizeof (int));
+  run->log_1 = calloc (nbatch, sizeof (int));
+  run->log_2 = calloc (nbatch, sizeof (int));
+  run->log_gr = calloc (nbatch, sizeof (int));
+  run->chains1 = malloc (sizeof (bz_chain *) * run->threads);
+  run->chains2 = malloc (sizeof (bz_chain *) * run->threads);
+  for (i = 0; i < run->threads; i++) {
+    run->chains1[i] = bz_newchain (run->brain1);
+    run->chains2[i] = bz_newchain (run->brain2);
+  }
+  //   the monitor looks over the last batch's games (two per
+  //   double-game) five times a batch
+  run->monitor = NULL;
+  if (run->stop_draws > 0 && run->nreplicas == 1) {
+    run->rule.outcome = 0;
+    run->rule.minrate = run->stop_draws;
+    run->rule.maxunderflow = run->stop_underflows;
+    run->rule.minwindow = 2 * run->batchsize;
+    run->monitor = bz_newmonitor (3, 2 * run->batchsize,
+				  (2 * run->batchsize + 4) / 5,
+				  bz_stoprate, &run->rule);
+    if (run->monitor == NULL) exit (1);
+    bz_monitorbrain (run->monitor, run->brain1);
+    bz_monitorbrain (run->monitor, run->brain2);
+  }
+  run->learner1 = run->learner2 = NULL;
+#ifdef ASYNC_LEARN
+  run->learner1 = bz_newlearner (run->brain1, 1 << 16);
+  run->learner2 = bz_newlearner (run->brain2, 1 << 16);
+#endif
+}
+
+//   Replicated training: this process is one of nreplicas (on this
+//   host or others) all training the same grid point, and every
+//   syncevery double-games they average their brains.   Each replica
+//   drops its deltas in syncdir (a shared directory will do across
+//   hosts), waits for everybody else's, and merges them in.
+static void ttt_writefile (char *name, void *data, long len) {
+  char tmp[strlen (name) + 8];
+  FILE *f;
+  sprintf (tmp, "%s.tmp", name);
+  f = fopen (tmp, "wb");
+  if (f == NULL || fwrite (data, 1, len, f) != (size_t) len) {
+    fprintf (stderr, "tictactoe: couldn't write %s\n", tmp);
+    exit (1);
+  }
+  fclose (f);
+  rename (tmp, name);    //  so nobody sees half a delta
+}
+
+static void *ttt_waitfile (char *name, long *len) {
+  FILE *f;
+  void *data;
+  while ((f = fopen (name, "rb")) == NULL) usleep (10000);
+  fseek (f, 0, SEEK_END);
+  *len = ftell (f);
+  rewind (f);
+  data = malloc (*len);
+  if (data == NULL || fread (data, 1, *len, f) != (size_t) *len) {
+    fprintf (stderr, "tictactoe: couldn't read %s\n", name);
+    exit (1);
+  }
+  fclose (f);
+  return (data);
+}
+
+//   A delta's file: ttt.s<runid>.p<point>.b<brain>.r<round>.n<replica>
+static void ttt_syncname (ttt_run *run, char *name, int b, long round,
+			  int r) {
+  sprintf (name, "%s/ttt.s%lu.p%ld.b%d.r%ld.n%d", run->syncdir, run->runid,
+	   run->point, b, round, r);
+}
+
+//   Any of our own files already in syncdir are from an earlier run with
+//   the same seed (only we write them), and the others would find its
+//   deltas and merge them as ours - so don't start.
+static void ttt_checksyncdir (ttt_run *run) {
+  char prefix[80], suffix[40];
+  struct dirent *e;
+  DIR *d;
+  size_t len;
+  sprintf (prefix, "ttt.s%lu.p%ld.b", run->runid, run->point);
+  sprintf (suffix, ".n%d", run->replica);
+  d = opendir (run->syncdir);
+  if (d == NULL) {
+    fprintf (stderr, "tictactoe: can't read syncdir %s\n", run->syncdir);
+    exit (1);
+  }
+  while ((e = readdir (d)) != NULL) {
+    len = strlen (e->d_name);
+    if (strncmp (e->d_name, prefix, strlen (prefix)) == 0
+	&& len > strlen (suffix)
+	&& strcmp (e->d_name + len - strlen (suffix), suffix) == 0) {
+      fprintf (stderr, "tictactoe: %s/%s is left over from an earlier run;"
+	       " use another --seed or empty %s\n", run->syncdir, e->d_name,
+	       run->syncdir);
+      exit (1);
+    }
+  }
+  closedir (d);
+}
+
+static void ttt_merge (bz_sync *sync, void *delta, long len, float weight,
+		       char *name) {
+  if (bz_deltamerge (sync, delta, len, weight) < 0) {
+    fprintf (stderr, "tictactoe: couldn't merge %s\n", name);
+    exit (1);
+  }
+}
+
+static void ttt_sync (ttt_run *run, bz_sync **syncs, long round) {
+  char name[strlen (run->syncdir) + 100];
+  void *delta;
+  long len;
+  int b, r;
+  float n;
+  n = run->nreplicas;
+  for (b = 0; b < 2; b++) {
+    len = bz_deltaencode (syncs[b], &delta);
+    if (len < 0) exit (1);
+    ttt_syncname (run, name, b, round, run->replica);
+    ttt_writefile (name, delta, len);
+    ttt_merge (syncs[b], delta, len, 1.0 / n - 1.0, name);
+    free (delta);
+  }
+  for (r = 0; r < run->nreplicas; r++) {
+    if (r == run->replica) continue;
+    for (b = 0; b < 2; b++) {
+      ttt_syncname (run, name, b, round, r);
+      delta = ttt_waitfile (name, &len);
+      ttt_merge (syncs[b], delta, len, 1.0 / n, name);
+      free (delta);
+    }
+  }
+  //   everybody has read round-2 by now (they've written round-1)
+  for (b = 0; b < 2 && round >= 2; b++) {
+    ttt_syncname (run, name, b, round - 2, run->replica);
+    unlink (name);
+  }
+}
+
+//   Play all the double-games (or until the monitor's seen enough),
+//   then drop the chains and learners; the brains and logs stay for
+//   ttt_score and ttt_killrun.
+void ttt_train (ttt_run *run) {
+  long i, done, n, ran, round;
+  bz_sync *syncs[2];
+  if (run->nreplicas > 1) {
+    ttt_checksyncdir (run);
+    syncs[0] = bz_newsync (run->brain1);
+    syncs[1] = bz_newsync (run->brain2);
+    if (syncs[0] == NULL || syncs[1] == NULL) exit (1);
+  }
+  for (done = round = 0; done < run->repeats; done += n, round++) {
+    n = run->repeats - done;
+    if (run->nreplicas > 1 && n > run->syncevery) n = run->syncevery;
+    run->first = done;
+    ran = bz_trainparallel (run->threads, n, run->seed + done, ttt_episode,
+			    run);
+    if (run->nreplicas > 1) {
+      if (run->learner1) bz_learnerflush (run->learner1);
+      if (run->learner2) bz_learnerflush (run->learner2);
+      ttt_sync (run, syncs, round);
+    }
+    if (run->monitor && bz_monitorstopped (run->monitor)) {
+      done += ran;
+      break;
+    }
+  }
+  run->played = done;
+  if (run->nreplicas > 1) {
+    bz_killsync (syncs[0]);
+    bz_killsync (syncs[1]);
+  }
+  bz_killlearner (run->learner1);    //  (after they've caught up)
+  bz_killlearner (run->learner2);
+  for (i = 0; i < run->threads; i++) {
+    bz_killchain (run->chains1[i]);
+    bz_killchain (run->chains2[i]);
+  }
+  free (run->chains1);
+  free (run->chains2);
+}
+
+//   50% and 90% points for draws, and the last batch with an underflow.
+//   If verbose, print the per-batch table on the way.
+void ttt_score (ttt_run *run, int verbose) {
+  long batch, nbatch;
+  run->p50 = run->p90 = 999999999;
+  run->ctpp = 0;
+  //   (only the batches we finished, if the monitor stopped us - a
+  //   last few games aren't a batch to take percentages of)
+  nbatch = run->played / run->batchsize;
+  if (nbatch > run->repeats / run->batchsize)
+    nbatch = run->repeats / run->batchsize;
+  for (batch = 0; batch < nbatch; batch++) {
+    if (verbose)
+      printf (" %9ld %9d %9d %9d %9d\n",
+	      batch*run->batchsize, run->log_1[batch], run->log_2[batch],
+	      run->log_0[batch], run->log_gr[batch] );
+    if (run->log_1[batch] < run->log_0[batch]
+	&& run->log_2[batch] < run->log_0[batch]
+	&& batch*run->batchsize < run->p50)
+      run->p50 = batch*run->batchsize;
+    if (10 * run->log_1[batch] < run->log_0[batch]
+	&& 10 * run->log_2[batch] < run->log_0[batch]
+	&& batch*run->batchsize < run->p90)
+      run->p90 = batch*run->batchsize;
+    if (run->log_gr[batch] > 0) run->ctpp = batch * run->batchsize;
+  }
+}
 
-int execute_move (int square, int value);
+void ttt_killrun (ttt_run *run) {
+  bz_killbrain (run->brain1);
+  bz_killbrain (run->brain2);
+  free (run->log_0);
+  free (run->log_1);
+  free (run->log_2);
+  free (run->log_gr);
+  bz_killmonitor (run->monitor);
+}
+
+//    Sweeping.   Every knob can be given a comma-separated list of
+//    values; we run every combination (the grid), each with its own
+//    brain pair, "jobs" of them at a time, and print one line per grid
+//    point.   With "--shard i/n" this process only runs grid points
+//    i, i+n, i+2n ... so n hosts can split a sweep between them and
+//    the tables just get concatenated.
+#define SWEEP_KNOBS 10
+#define SWEEP_MAXVALS 64
+static struct {
+  char *name;
+  int nvals;
+  double vals[SWEEP_MAXVALS];
+} sweep_knobs[SWEEP_KNOBS] = {
+  { "tokens", 0, { 0 } }, { "repeats", 0, { 0 } }, { "batch", 0, { 0 } },
+  { "evse", 0, { 0 } }, { "win-add", 0, { 0 } }, { "win-mul", 0, { 0 } },
+  { "lose-add", 0, { 0 } }, { "lose-mul", 0, { 0 } },
+  { "draw-add", 0, { 0 } }, { "draw-mul", 0, { 0 } } };
+
+typedef struct my_ttt_sweep {
+  ttt_run base;           //  knobs nobody asked to sweep
+  long npoints;           //  in the whole grid
+  long shard, nshards;
+  ttt_run *runs;          //  one per grid point in this shard
+} ttt_sweep;
+
+//   Grid point p's knobs: the last knob varies fastest.
+static void sweep_point (ttt_sweep *sw, long p, ttt_run *run) {
+  int k;
+  double v[SWEEP_KNOBS];
+  *run = sw->base;
+  for (k = SWEEP_KNOBS - 1; k >= 0; k--) {
+    v[k] = 0;
+    if (sweep_knobs[k].nvals == 0) continue;
+    v[k] = sweep_knobs[k].vals[p % sweep_knobs[k].nvals];
+    p /= sweep_knobs[k].nvals;
+  }
+  if (sweep_knobs[0].nvals) run->tokens = v[0];
+  if (sweep_knobs[1].nvals) run->repeats = v[1];
+  if (sweep_knobs[2].nvals) run->batchsize = v[2];
+  if (sweep_knobs[3].nvals) {
+    //   an evse of 0 means flat (NULL), like FLAT_EVSE
+    run->flat_evse = (v[3] == 0);
+    run->evse = run->flat_evse ? 1.0 : v[3];
+  }
+  if (sweep_knobs[4].nvals) run->win_add = v[4];
+  if (sweep_knobs[5].nvals) run->win_mul = v[5];
+  if (sweep_knobs[6].nvals) run->lose_add = v[6];
+  if (sweep_knobs[7].nvals) run->lose_mul = v[7];
+  if (sweep_knobs[8].nvals) run->draw_add = v[8];
+  if (sweep_knobs[9].nvals) run->draw_mul = v[9];
+}
+
+//   The "episodes" of the sweep are whole training runs.
+int ttt_sweep_episode (void *userdata, int worker, bz_rng *rng, long i) {
+  ttt_sweep *sw;
+  ttt_run *run;
+  long p;
+  sw = (ttt_sweep *) userdata;
+  p = sw->shard + i * sw->nshards;
+  run = &sw->runs[i];
+  sweep_point (sw, p, run);
+  run->point = p;
+  //   seeded by grid point, so a point's result doesn't depend on how
+  //   the sweep was sharded or scheduled
+  run->seed = sw->base.seed + (unsigned long) p * 1000;
+  ttt_newrun (run);
+  ttt_train (run);
+  ttt_score (run, 0);
+  ttt_killrun (run);
+  return (0);
+}
+
+static void sweep_usage () {
+  int k;
+  fprintf (stderr, "usage: tictactoe [--KNOB v1,v2,...]... [--threads T]"
+	   " [--jobs J] [--shard I/N] [--seed S]\n"
+	   "         [--replica I/N [--syncevery K] [--syncdir DIR]]\n"
+	   "         [--stop-draws D [--stop-underflows U]]\n  knobs:");
+  for (k = 0; k < SWEEP_KNOBS; k++) fprintf (stderr, " %s", sweep_knobs[k].name);
+  fprintf (stderr, "\n  (evse 0 means flat)\n");
+  exit (1);
+}
+
+int ttt_sweep_main (int argc, char **argv) {
+  ttt_sweep sw;
+  ttt_run *run;
+  long i, nmine;
+  int a, k, jobs;
+  char *cursor, *end;
+  ttt_defaults (&sw.base);
+  sw.shard = 0;
+  sw.nshards = 1;
+  jobs = 1;
+  for (a = 1; a < argc; a++) {
+    if (a + 1 >= argc || strncmp (argv[a], "--", 2) != 0) sweep_usage ();
+    if (strcmp (argv[a], "--threads") == 0) {
+      sw.base.threads = atoi (argv[++a]);
+      if (sw.base.threads < 1) sweep_usage ();
+      continue;
+    }
+    if (strcmp (argv[a], "--jobs") == 0) {
+      jobs = atoi (argv[++a]);
+      if (jobs < 1) sweep_usage ();
+      continue;
+    }
+    if (strcmp (argv[a], "--seed") == 0) {
+      sw.base.seed = strtoul (argv[++a], NULL, 10);
+      continue;
+    }
+    if (strcmp (argv[a], "--replica") == 0) {
+      if (sscanf (argv[++a], "%d/%d", &sw.base.replica, &sw.base.nreplicas) != 2
+	  || sw.base.nreplicas < 1 || sw.base.replica < 0
+	  || sw.base.replica >= sw.base.nreplicas)
+	sweep_usage ();
+      continue;
+    }
+    if (strcmp (argv[a], "--syncevery") == 0) {
+      sw.base.syncevery = atol (argv[++a]);
+      if (sw.base.syncevery < 1) sweep_usage ();
+      continue;
+    }
+    if (strcmp (argv[a], "--syncdir") == 0) {
+      sw.base.syncdir = argv[++a];
+      continue;
+    }
+    if (strcmp (argv[a], "--stop-draws") == 0) {
+      sw.base.stop_draws = atof (argv[++a]);
+      continue;
+    }
+    if (strcmp (argv[a], "--stop-underflows") == 0) {
+      sw.base.stop_underflows = atof (argv[++a]);
+      continue;
+    }
+    if (strcmp (argv[a], "--shard") == 0) {
+      if (sscanf (argv[++a], "%ld/%ld", &sw.shard, &sw.nshards) != 2
+	  || sw.nshards < 1 || sw.shard < 0 || sw.shard >= sw.nshards)
+	sweep_usage ();
+      continue;
+    }
+    for (k = 0; k < SWEEP_KNOBS; k++)
+      if (strcmp (argv[a] + 2, sweep_knobs[k].name) == 0) break;
+    if (k == SWEEP_KNOBS) sweep_usage ();
+    cursor = argv[++a];
+    sweep_knobs[k].nvals = 0;
+    while (*cursor && sweep_knobs[k].nvals < SWEEP_MAXVALS) {
+      sweep_knobs[k].vals[sweep_knobs[k].nvals++] = strtod (cursor, &end);
+      if (end == cursor || (*end != ',' && *end != '\0')) sweep_usage ();
+      //   (a batch of no games would be divided by)
+      if (k == 2 && sweep_knobs[k].vals[sweep_knobs[k].nvals - 1] < 1)
+	sweep_usage ();
+      cursor = (*end == ',') ? end + 1 : end;
+    }
+  }
+  if (sw.base.stop_draws > 0 && sw.base.nreplicas > 1)
+    fprintf (stderr, " (replicas always play every game; not stopping early)\n");
+  //   replicas all start alike but play different games
+  sw.base.runid = sw.base.seed;
+  sw.base.seed += 7919 * sw.base.replica;
+  sw.npoints = 1;
+  for (k = 0; k < SWEEP_KNOBS; k++)
+    if (sweep_knobs[k].nvals) sw.npoints *= sweep_knobs[k].nvals;
+  nmine = (sw.npoints - sw.shard + sw.nshards - 1) / sw.nshards;
+  fprintf (stderr, " Sweeping %ld of %ld grid points, %d at a time.\n",
+	   nmine, sw.npoints, jobs);
+  sw.runs = malloc (sizeof (ttt_run) * (nmine > 0 ? nmine : 1));
+  //   with several points at once, each point's own workers share its
+  //   two brains (so keep --threads at 1 unless jobs < cores)
+  bz_trainparallel (jobs, nmine, 0, ttt_sweep_episode, &sw);
 
+  printf ("point    tokens   repeats     batch  evse   winadd winmul"
+	  "  loseadd losemul  drawadd drawmul         P50         P90  lastunderflow"
+	  "     played\n");
+  for (i = 0; i < nmine; i++) {
+    run = &sw.runs[i];
+    printf ("%5ld %9ld %9ld %9ld %5.2f %8.3f %6.3f %8.3f %7.3f %8.3f %7.3f"
+	    " %11ld %11ld %14ld %10ld\n",
+	    sw.shard + i * sw.nshards, run->tokens, run->repeats,
+	    run->batchsize, run->flat_evse ? 0.0 : run->evse,
+	    run->win_add, run->win_mul, run->lose_add, run->lose_mul,
+	    run->draw_add, run->draw_mul, run->p50, run->p90, run->ctpp,
+	    run->played);
+  }
+  free (sw.runs);
+  bz_killcanon (ttt_canon);
+  return (0);
+}
 
-void main ()
+int main (int argc, char **argv)
 {
-  printf ("Starting test 2 - learning tic-tac-toe\n");
+  ttt_run one, *run;
+  run = &one;
   bz_init();
+  init_ttt_tables ();
+  ttt_canon = NULL;
+  ttt_reps = NULL;
+#ifdef SYMMETRY
+  ttt_canon = make_ttt_canon ();
+#endif
+  //   any arguments at all means a sweep
+  if (argc > 1) return (ttt_sweep_main (argc, argv));
+
+  printf ("Starting test 2 - learning tic-tac-toe\n");
+  ttt_defaults (run);
+  if (ttt_canon)
+    printf (" Folding the %d boards by symmetry leaves %ld.\n",
+	    STATES, ttt_canon->ncanon);
   
   printf (" Initializing two brains.  They'll alternate who goes first.\n");
-  brain1 = bz_newbrain (BZ_BRAIN_QUANTIZED, STATES, ACTIONS, TOKENS);
-  brain2 = bz_newbrain (BZ_BRAIN_QUANTIZED, STATES, ACTIONS, TOKENS);
-  printf ("Got brains! pointers are %li and %li\n",(long) brain1,(long) brain2);
+  ttt_newrun (run);
+  printf ("Got brains! pointers are %li and %li\n",
+	  (long) run->brain1, (long) run->brain2);
 
-  printf (" I would like to play %d double-games of tic-tac-toe.  Against myself.\n", REPEATS);
+  printf (" I would like to play %ld double-games of tic-tac-toe.  Against myself.\n", run->repeats);
 
   printf ("\nLearning coeffs: Explore vs Exploit: %f\n Add    Mul \n  W: %f %f\n  L: %f %f\n  D: %f %f \n",
-	  EVSE, WIN_MUL, WIN_ADD, LOSE_MUL, LOSE_ADD, DRAW_MUL, DRAW_ADD );
+	  run->evse, run->win_mul, run->win_add, run->lose_mul,
+	  run->lose_add, run->draw_mul, run->draw_add );
 	  //WIN_MUL, WIN_ADD, LOSE_MUL, LOSE_ADD, DRAW_MUL, DRAW_ADD );
 
-  int reps, i, j, action, batch;
-  action = 0;
-  int log_0 [REPEATS/BATCHSIZE];
-  int log_1 [REPEATS/BATCHSIZE];
-  int log_2 [REPEATS/BATCHSIZE];
-  int log_gr [REPEATS/BATCHSIZE];
-  for (i = 0; i < (REPEATS/BATCHSIZE); i++) log_0[i] = log_1[i] = log_2[i] = log_gr[i] = 0;
-  for (reps = 0; reps < REPEATS; reps++) {
-    batch = reps/BATCHSIZE;
-    gamblers_ruins = & (log_gr[batch]);
-    //printf (" Starting game %d \n", reps);
-    chain1 = bz_newchain (brain1);
-    chain2 = bz_newchain (brain2);
-    action = play_ttt ( brain1, chain1, brain2, chain2, gamblers_ruins);
-    bz_killchain (chain1);
-    bz_killchain (chain2);
-    if (action == 0) { log_0[batch]++; };
-    if (action == 1) { log_1[batch]++; };
-    if (action == 2) { log_2[batch]++; };
-    chain1 = bz_newchain (brain1);
-    chain2 = bz_newchain (brain2);
-    action = play_ttt ( brain2, chain2, brain1, chain1, gamblers_ruins);
-    bz_killchain (chain1);
-    bz_killchain (chain2);
-    if (action == 0) { log_0[batch]++; };
-    if (action == 1) { log_1[batch]++; };
-    if (action == 2) { log_2[batch]++; };
-  }
+#ifdef ASYNC_LEARN
+  printf (" Learning in the background.\n");
+#endif
+  printf (" Playing on %d thread(s).\n", run->threads);
+  if (run->monitor)
+    printf (" Stopping early once %.1f%% of a batch's games are draws.\n",
+	    100.0 * run->stop_draws);
+#ifdef CHECKPOINT
+  bz_checkpointer *cp1, *cp2;
+  cp1 = bz_newcheckpointer (run->brain1, CHECKPOINT ".1", CHECKPOINT_SECS);
+  cp2 = bz_newcheckpointer (run->brain2, CHECKPOINT ".2", CHECKPOINT_SECS);
+#endif
+  ttt_train (run);
+#ifdef CHECKPOINT
+  bz_killcheckpointer (cp1);
+  bz_killcheckpointer (cp2);
+#endif
 
+  if (run->monitor && bz_monitorstopped (run->monitor)) {
+    bz_monstats st;
+    bz_monitorstats (run->monitor, &st);
+    printf (" Stopped after %ld double-games: %.1f%% draws, underflow rate"
+	    " %.2g, row entropy %.3f over %ld rows\n", run->played,
+	    100.0 * st.rate[0], st.underflowrate, st.entropy, st.rows);
+  }
   printf ("Overall Results: \n   Pttn         P1      P2       Draw    Underflows\n");
-  long p50, p90, ctpp;  // 50% and 90% points for draws, underflows
-  p50 = p90 = 999999999;
-  ctpp = 0;
-  for (batch = 0; batch < (REPEATS / BATCHSIZE); batch++) {
-    printf (" %9d %9d %9d %9d %9d\n",
-	    batch*BATCHSIZE, log_1[batch], log_2[batch],
-	    log_0[batch], log_gr[batch] );
-    if (log_1[batch] < log_0[batch] && log_2[batch] < log_0[batch]
-	&& batch*BATCHSIZE < p50)
-      p50 = batch*BATCHSIZE;
-    if (10 * log_1[batch] < log_0[batch] && 10 * log_2[batch] < log_0[batch]
-	&& batch*BATCHSIZE < p90)
-      p90 = batch*BATCHSIZE;
-    if (log_gr[batch] > 0) ctpp = batch * BATCHSIZE;
-  }
-  printf ("\n P50 at %d, P90 at %d, final underflow at %d \n", p50, p90, ctpp);
+  ttt_score (run, 1);
+  printf ("\n P50 at %ld, P90 at %ld, final underflow at %ld \n",
+	  run->p50, run->p90, run->ctpp);
+  printf (" Brain rows in use: %ld and %ld\n",
+	  bz_brainrows (run->brain1), bz_brainrows (run->brain2));
+  {
+    char *st;
+    st = bz_status (run->brain1);
+    printf (" Brain 1: %s\n", st ? st : "?");
+    free (st);
+    st = bz_status (run->brain2);
+    printf (" Brain 2: %s\n", st ? st : "?");
+    free (st);
+  }
+  {
+    //   what they'd play with the exploring turned off
+    bz_policy *g1, *g2;
+    static char *said[] = { "", "P1 wins", "P2 wins" };
+    int r1, r2;
+    g1 = bz_newpolicy (run->brain1, ttt_legal, NULL);
+    g2 = bz_newpolicy (run->brain2, ttt_legal, NULL);
+    if (g1 && g2) {
+      r1 = ttt_greedygame (g1, g2);
+      r2 = ttt_greedygame (g2, g1);
+      printf (" Greedy policies (%ld bytes each, from %ld of floats):"
+	      " %s, then %s\n", g1->bytes,
+	      (long) (sizeof (float) * run->brain1->maxstates * ACTIONS),
+	      r1 < 0 ? "draw" : said[r1], r2 < 0 ? "draw" : said[r2]);
+    }
+    bz_killpolicy (g1);
+    bz_killpolicy (g2);
+  }
+  ttt_killrun (run);
+  bz_killcanon (ttt_canon);
+  free (ttt_reps);
   printf ("All done.  That was fun.  Play more later.\n");
+  return (0);
 }
 
-//    Determine victory conditions - returns either 0 (neither), -1 (draw),
-//    1 (brain1 won, or 2 (brain2 won).
-//    NOTE: it's perfectly possible to have different victory conditions for
-//    brain1 and brain2.
-//    We number the cells top to bottom, then left to right.  Note that this
-//    is the ONLY PLACE THAT MATTERS!  Why?  Because our algorithm knows nothing
-//    of the actual rules, only those state combinations when it wins!
+//    The board is a pair of bitboards: bit i of x is set if brain-1's
+//    mark is on cell i, same for o and brain-2.   We number the cells
+//    top to bottom, then left to right.  Note that this is the ONLY
+//    PLACE THAT MATTERS!  Why?  Because our algorithm knows nothing of
+//    the actual rules, only those state combinations when it wins!
 //      0 1 2
 //      3 4 5
 //      6 7 8
 //
-int victory() {
-  //  victory player 2
-  if ((gb[0] == 2 ) && ( gb[1] == 2 ) && ( gb[2] == 2)) return 2;
-  if ((gb[3] == 2 ) && ( gb[4] == 2 ) && ( gb[5] == 2)) return 2;
-  if ((gb[6] == 2 ) && ( gb[7] == 2 ) && ( gb[8] == 2)) return 2;
-  if ((gb[0] == 2 ) && ( gb[3] == 2 ) && ( gb[6] == 2)) return 2;
-  if ((gb[1] == 2 ) && ( gb[4] == 2 ) && ( gb[7] == 2)) return 2;
-  if ((gb[2] == 2 ) && ( gb[5] == 2 ) && ( gb[8] == 2)) return 2;
-  if ((gb[0] == 2 ) && ( gb[4] == 2 ) && ( gb[8] == 2)) return 2;
-  if ((gb[6] == 2 ) && ( gb[4] == 2 ) && ( gb[2] == 2)) return 2;
-  
-  //  victory player 1
-  if ((gb[0] == 1 ) && ( gb[1] == 1 ) && ( gb[2] == 1)) return 1;
-  if ((gb[3] == 1 ) && ( gb[4] == 1 ) && ( gb[5] == 1)) return 1;
-  if ((gb[6] == 1 ) && ( gb[7] == 1 ) && ( gb[8] == 1)) return 1;
-  if ((gb[0] == 1 ) && ( gb[3] == 1 ) && ( gb[6] == 1)) return 1;
-  if ((gb[1] == 1 ) && ( gb[4] == 1 ) && ( gb[7] == 1)) return 1;
-  if ((gb[2] == 1 ) && ( gb[5] == 1 ) && ( gb[8] == 1)) return 1;
-  if ((gb[0] == 1 ) && ( gb[4] == 1 ) && ( gb[8] == 1)) return 1;
-  if ((gb[6] == 1 ) && ( gb[4] == 1 ) && ( gb[2] == 1)) return 1;
+//    The base-3 state the brains see (cell i is digit i, 0 empty, 1 or 2
+//    for whose mark) is kept up to date one move at a time rather than
+//    being recomputed from the whole board.
+struct my_ttt_board {
+  int x, o;      //  9-bit masks
+  long state;    //  base-3 encoding of the board
+};
+
+#define TTT_FULL 0x1ff
+
+//    the eight ways to win: three rows, three columns, two diagonals
+static const int ttt_lines[8] = {
+  0x007, 0x038, 0x1c0, 0x049, 0x092, 0x124, 0x111, 0x054 };
+
+static const long ttt_pow3[9] = { 1, 3, 9, 27, 81, 243, 729, 2187, 6561 };
+
+//    ttt_wins[m] is 1 if the cells in m include a whole line.
+static char ttt_wins[TTT_FULL + 1];
+
+void init_ttt_tables () {
+  int m, l;
+  for (m = 0; m <= TTT_FULL; m++) {
+    ttt_wins[m] = 0;
+    for (l = 0; l < 8; l++)
+      if ((m & ttt_lines[l]) == ttt_lines[l]) ttt_wins[m] = 1;
+  }
+}
+
+//    What's on cell i: 0 empty, 1 or 2 for whose mark (for printing).
+static inline int ttt_cell (ttt_board *b, int i) {
+  return ((b->x >> i) & 1) ? 1 : ((b->o >> i) & 1) ? 2 : 0;
+}
+
+//    Determine victory conditions - returns either 0 (neither), -1 (draw),
+//    1 (brain1 won, or 2 (brain2 won).   Only the player who just moved
+//    can have just won, so that's the only side we look at.
+//    NOTE: it's perfectly possible to have different victory conditions for
+//    brain1 and brain2.
+static inline int victory (ttt_board *b, int mover) {
+  if (ttt_wins[mover == 1 ? b->x : b->o]) return mover;
   //   draw condition - all cells filled, no winner
-  if (gb[1] != 0 && gb[2] != 0 && gb[3] != 0
-      && gb[4] != 0 && gb[5] != 0 && gb[6] != 0
-      && gb[7] != 0 && gb[8] != 0 && gb[0] != 0)
-    return -1;
+  if ((b->x | b->o) == TTT_FULL) return -1;
   //   No winner yet, keep playing!
   return 0;
 }
 
-//   GBS - Game Board State.   Convert the gameboard gb into an int state.
-//  Simple conversion from an array via base-3 encoding.
-long gbs(int gb[9]) {
-  int rval;
-  rval = (1 * gb[0]
-	  + 3 * gb[1]
-	  + 9 * gb[2]
-	  + 27 * gb[3]
-	  + 81 * gb[4]
-	  + 243 * gb[5]
-	  + 729 * gb[6]
-	  + 2187 * gb[7]
-	  + 6561 * gb[8]);
-  return rval;
+//    The D4 symmetries of the board: four rotations, each with and
+//    without a left-right flip.   ttt_perms[t][i] is where cell i goes
+//    under symmetry t; symmetry 0 is the identity.
+static int ttt_perms[8][9];
+
+static long ttt_apply (void *userdata, long state, int t) {
+  long out;
+  int i;
+  out = 0;
+  for (i = 0; i < 9; i++) {
+    out += (state % 3) * ttt_pow3[ttt_perms[t][i]];
+    state /= 3;
+  }
+  return (out);
+}
+
+bz_canon *make_ttt_canon () {
+  int t, i, r, c, k, tmp;
+  for (t = 0; t < 8; t++)
+    for (i = 0; i < 9; i++) {
+      r = i / 3;
+      c = i % 3;
+      for (k = 0; k < t / 2; k++) {   //  rotate a quarter turn
+	tmp = r;
+	r = c;
+	c = 2 - tmp;
+      }
+      if (t & 1) c = 2 - c;           //  and maybe flip
+      ttt_perms[t][i] = 3 * r + c;
+    }
+  return (bz_newcanon (STATES, ACTIONS, 8, &ttt_perms[0][0], ttt_apply, NULL));
+}
+
+//    The legal moves in a brain state, for bz_newpolicy: the empty cells
+//    of the board it stands for.   A canonical state stands for the
+//    board that is its own representative (the one with symmetry 0),
+//    so its cells are already in the canonical frame.
+int ttt_legal (void *userdata, long state, bz_maskword *legalbits) {
+  long raw, s;
+  int i, empty;
+  if (ttt_canon && ttt_reps == NULL) {
+    ttt_reps = malloc (sizeof (long) * ttt_canon->ncanon);
+    for (s = 0; s < STATES; s++)
+      if (ttt_canon->sym[s] == 0) ttt_reps[ttt_canon->canon[s]] = s;
+  }
+  raw = ttt_canon ? ttt_reps[state] : state;
+  empty = 0;
+  for (i = 0; i < 9; i++) {
+    if (raw % 3 == 0) empty |= 1 << i;
+    raw /= 3;
+  }
+  legalbits[0] = empty;
+  return (empty != 0);
+}
+
+//    A policy's move on a raw board, through the symmetry tables if the
+//    brain learned canonical boards.
+static long ttt_greedymove (bz_policy *p, long state) {
+  long a;
+  int sym;
+  if (ttt_canon) {
+    a = bz_policyaction (p, bz_canonstate (ttt_canon, state, &sym));
+    return (a < 0 ? 0 : ttt_canon->inv[sym * ACTIONS + a]);
+  }
+  a = bz_policyaction (p, state);
+  return (a < 0 ? 0 : a);
+}
+
+//    One game between two greedy policies, no learning.   Same return
+//    as victory(): 1 or 2 for who won, -1 for a draw.
+int ttt_greedygame (bz_policy *first, bz_policy *second) {
+  ttt_board board;
+  int mover, victor;
+  board.x = board.o = 0;
+  board.state = 0;
+  mover = 1;
+  victor = 0;
+  while (victor == 0) {
+    execute_move (&board, ttt_greedymove (mover == 1 ? first : second,
+					  board.state), mover);
+    victor = victory (&board, mover);
+    mover = 3 - mover;
+  }
+  return (victor);
+}
+
+//    Choose and record moves, through the symmetry tables if we have them.
+static inline long ttt_pick (bz_brain *brain, bz_rng *rng, long state,
+			     float *evse, bz_maskword *legal, int *ruins) {
+  if (ttt_canon)
+    return (bz_nextaction_canon (brain, ttt_canon, rng, state, evse,
+				 legal, ruins));
+  return (bz_nextaction_bits (brain, rng, state, evse, legal, ruins));
+}
+
+static inline void ttt_record (bz_chain *chain, long state, long move,
+			       bz_maskword *legal) {
+  if (ttt_canon) bz_addtochain_canon (chain, ttt_canon, state, move, legal);
+  else bz_addtochain_bits (chain, state, move, legal);
+}
+
+//    Learn a finished game now, or hand it to that brain's learner.
+static void ttt_learn (ttt_run *run, bz_brain *brain, bz_chain *chain,
+		       float add, float multiply) {
+  bz_learner *l;
+  l = (brain == run->brain1) ? run->learner1
+    : (brain == run->brain2) ? run->learner2 : NULL;
+  if (l) bz_learnchain_async (l, chain, add, multiply);
+  else bz_learnchain (brain, chain, add, multiply, NULL);
+}
+
+void show_board (char *what, ttt_board *b, long n1, long n2, long n3) {
+  int i;
+  printf ("%s", what);
+  for (i = 0; i < 9; i++) printf ("%d", ttt_cell (b, i));
+  printf (" %ld %ld %ld\n", n1, n2, n3);
 }
 
-  
 //   Play one game of tic-tac-toe, b1 versus b2
-int play_ttt( bz_brain *b1, bz_chain *s1,
+int play_ttt( ttt_run *run,
+	      bz_brain *b1, bz_chain *s1,
 	      bz_brain *b2, bz_chain *s2,
-	      int *gamblers_ruin) {
-  long i, movecount, move, victor, state;
-  char mask[9];
+	      bz_rng *rng, int *gamblers_ruin) {
+  long movecount, move, victor, state;
+  ttt_board board;
+  bz_maskword legal;   //  the empty cells are the legal moves
   int showboards;
-  bz_brain *btemp;
-  bz_chain *ctemp;
   float local_expval;
-  local_expval = EVSE;
+  float *evse;
+  local_expval = run->evse;
+  evse = run->flat_evse ? NULL : &local_expval;
   showboards = 0;
   //   Start with a blank board.
-  for (i = 0; i < 9; i++) gb[i] = 0;
+  board.x = board.o = 0;
+  board.state = 0;
   victor = 0;
   //   loop till someone wins (or not).
   movecount = 0;  //  for when we're only allowing 4 moves each side.
   while ( victor == 0 && movecount < MAX_TURNS ) {
     movecount++;
     //   get b1's next move
-    state = gbs (gb);  // turn the gameboard into an integer "state"
-    for (i = 0; i < 9; i++) {
-      mask[i] = gb[i] ? -1 : 1; // (gb[i]);  //create a mask of legal moves
-    }
+    state = board.state;
+    legal = TTT_FULL & ~(board.x | board.o);
     //  Shortcut - allow 1st move to be only NW corner, top side, or center
 //#define CANONICAL
 #ifdef CANONICAL
-    if (movecount == 0) {
-      mask [0] = mask[1] = mask[4] = 1;
-      mask [2] = mask[3] = mask[5] = mask[6] = mask[7] = mask[8] = -1;
-    }
+    if (movecount == 0) legal = 0x013;
 #endif
-#ifdef FLAT_EVSE
-    move = bz_nextaction (b1, state, NULL, mask, gamblers_ruin);
-#else    
-    move = bz_nextaction (b1, state, &local_expval, mask, gamblers_ruin);
-#endif
-    
-    if (showboards) printf ("Board: %d%d%d%d%d%d%d%d%d S: %d P%d moves %d \n",
-        gb[0],gb[1],gb[2],gb[3],gb[4],gb[5],gb[6],gb[7],gb[8],
-			    state, 1, move);
-    if (showboards) printf ("Mask:  %d%d%d%d%d%d%d%d%d \n",
-       mask[0],mask[1],mask[2],mask[3],mask[4],mask[5],mask[6],mask[7],mask[8]);
+    move = ttt_pick (b1, rng, state, evse, &legal, gamblers_ruin);
+    if (showboards) show_board ("Board/S/P/move: ", &board, state, 1, move);
     //   execute the move (if it's illegal, take next legal one.)
     //    Yes, that's suboptimal.  GROT GROT GROT
-    bz_addtochain (s1, state, move, mask);
-    // printf ("executing move\n");
-    execute_move (move, 1);
+    ttt_record (s1, state, move, &legal);
+    execute_move (&board, move, 1);
     //  check, did someone win?  Exit the while-loop if they did!
-    victor =  victory();
+    victor = victory (&board, 1);
     if (victor != 0) break;
     //   No winner, let b2 take a turn
     movecount++;
     if (movecount > MAX_TURNS) break;
-    state = gbs (gb);
-    for (i = 0; i < 9; i++) mask[i] = !(gb[i]);
-#ifdef FLAT_EVSE
-    move = bz_nextaction (b2, state, NULL, mask, gamblers_ruin);
+    state = board.state;
+    legal = TTT_FULL & ~(board.x | board.o);
+    //   b2 has always chosen from all nine cells (its old char mask said
+    //   0, not -1, for taken cells; execute_move then slides over to an
+    //   empty one), and only had the real mask for learning.   Keep it
+    //   that way so runs stay comparable, unless asked otherwise.
+//#define P2_SEES_MASK
+#ifdef P2_SEES_MASK
+    move = ttt_pick (b2, rng, state, evse, &legal, gamblers_ruin);
 #else
-    move = bz_nextaction (b2, state, &local_expval, mask, gamblers_ruin);
-#endif
-    
-    if (showboards) printf ( "Board: %d%d%d%d%d%d%d%d%d S: %d P%d moves %d \n",
-	    gb[0],gb[1],gb[2],gb[3],gb[4],gb[5],gb[6],gb[7],gb[8],
-			     state, 2, move);
-    if (showboards) printf ("Mask:  %d%d%d%d%d%d%d%d%d \n",
-       mask[0],mask[1],mask[2],mask[3],mask[4],mask[5],mask[6],mask[7],mask[8]);
+    move = ttt_pick (b2, rng, state, evse, NULL, gamblers_ruin);
+#endif
+    if (showboards) show_board ("Board/S/P/move: ", &board, state, 2, move);
     //  execute that move
-    bz_addtochain (s2, state, move, mask);
-    execute_move (move, 2);
+    ttt_record (s2, state, move, &legal);
+    execute_move (&board, move, 2);
     //  did someone win?
-    victor = victory();
+    victor = victory (&board, 2);
     if (victor != 0) break;
   }
-  if (showboards)  fprintf (stderr, "victor: %d board: %d%d%d %d%d%d %d%d%d \n",
-  	   victor,
-  	   gb[0],gb[1],gb[2],gb[3],gb[4],gb[5],gb[6],gb[7],gb[8]);
+  if (showboards) show_board ("victor/board: ", &board, victor, 0, 0);
   if (victor == 1) {
     if (PRINT_EACHGAME) fprintf (stderr, "A");
-    bz_learnchain (b1, s1, WIN_ADD, WIN_MUL, NULL);  //  add, then multiply
-    bz_learnchain (b2, s2, LOSE_ADD, LOSE_MUL, NULL);
+    ttt_learn (run, b1, s1, run->win_add, run->win_mul);  //  add, then multiply
+    ttt_learn (run, b2, s2, run->lose_add, run->lose_mul);
     return 1 ;
   }
   if (victor == 2) {
     if (PRINT_EACHGAME) fprintf (stderr, "B");
-    bz_learnchain (b2, s2, WIN_ADD, WIN_MUL, NULL);
-    bz_learnchain (b1, s1, LOSE_ADD, LOSE_MUL, NULL);
+    ttt_learn (run, b2, s2, run->win_add, run->win_mul);
+    ttt_learn (run, b1, s1, run->lose_add, run->lose_mul);
     return 2;
   }
   //   No winner!
   if (PRINT_EACHGAME) fprintf (stderr, "X");
-  bz_learnchain (b2, s2, DRAW_ADD, DRAW_MUL, NULL);
-  bz_learnchain (b1, s1, DRAW_ADD, DRAW_MUL, NULL);
+  ttt_learn (run, b2, s2, run->draw_add, run->draw_mul);
+  ttt_learn (run, b1, s1, run->draw_add, run->draw_mul);
   return 0;
 }
 
 //    Take a tic-tac-toe move- action is which square to mark, value is 1 or 2
-int execute_move (int square, int value) {
-  int i, sq, legal;
-  legal = square;
-  //fprintf (stderr, "%d", legal);
-  //  take the first legal move from this square.
-  for (i = 0; i < 9; i++) {
-    sq = (square + i) % 9;
-    if (gb[sq] == 0) {
-      gb[sq] = value;
-      return (0);
-    }
+//    If that square's taken, take the first empty one after it (wrapping
+//    around), found by rotating the empty cells so "square" is bit 0.
+int execute_move (ttt_board *b, int square, int value) {
+  int empty, rot, sq;
+  empty = TTT_FULL & ~(b->x | b->o);
+  if (empty == 0) {
+    //  Not a single legal move exists. Return failure.
+    fprintf (stderr, "\nILLEGAL MOVE SUGGESTED, numbr %d of %d\n",
+	     square, square);
+    exit(0);
   }
-  //  Not a single legal move exists. Return failure.
-  //return (1);
-  fprintf (stderr, "\nILLEGAL MOVE SUGGESTED, numbr %d of %d\n", legal, square);
-  exit(0);
+  rot = ((empty >> square) | (empty << (9 - square))) & TTT_FULL;
+  sq = (square + __builtin_ctz (rot)) % 9;
+  if (value == 1) b->x |= 1 << sq;
+  else b->o |= 1 << sq;
+  b->state += value * ttt_pow3[sq];
+  return (0);
 }